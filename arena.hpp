@@ -0,0 +1,125 @@
+
+
+#ifndef _CSF_ARENA_HPP
+#define _CSF_ARENA_HPP
+
+
+#include "global.hpp"
+#include <new>
+#include <utility>
+
+
+namespace csf
+{
+
+class arena
+{
+private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    struct block
+    {
+        block *next;
+        size_t capacity;
+        size_t used;
+    };
+
+    block *m_head;
+    size_t m_used;          // 已分配给调用者的字节数
+    size_t m_reserved;      // 向系统申请的字节数
+
+
+    block* new_block(size_t capacity)
+    {
+        auto b = (block*) malloc(sizeof(block) + capacity);
+        abort_if(b == nullptr, "out of memory, arena block size %lu\n", (unsigned long) capacity);
+
+        b->next = nullptr;
+        b->capacity = capacity;
+        b->used = 0;
+        m_reserved += capacity;
+        return b;
+    }
+
+public:
+
+    arena() : m_head(nullptr), m_used(0), m_reserved(0) { }
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    ~arena()
+    {
+        for (block *b = m_head; b; ) {
+            block *next = b->next;
+            free(b);
+            b = next;
+        }
+        m_head = nullptr;
+    }
+
+
+    // 顺序分配，内存只在 arena 析构时统一释放
+    void* alloc(size_t len, size_t align = sizeof(void*))
+    {
+        if (len == 0) {
+            return nullptr;
+        }
+
+        if (m_head != nullptr) {
+            size_t offset = (m_head->used + align - 1) & ~(align - 1);
+            if (offset + len <= m_head->capacity) {
+                m_head->used = offset + len;
+                m_used += len;
+                return (uint8_t*) (m_head + 1) + offset;
+            }
+        }
+
+        block *b;
+        if (len > BLOCK_SIZE / 4) {
+            // 大块内存单独申请，挂在当前块之后，不浪费当前块的剩余空间
+            b = new_block(len);
+            if (m_head == nullptr) {
+                m_head = b;
+            } else {
+                b->next = m_head->next;
+                m_head->next = b;
+            }
+        }
+        else {
+            b = new_block(BLOCK_SIZE);
+            b->next = m_head;
+            m_head = b;
+        }
+
+        // 块头之后的地址按 sizeof(block) 对齐，满足常规的对齐要求
+        b->used = len;
+        m_used += len;
+        return b + 1;
+    }
+
+
+    // 在 arena 中构造对象，析构函数不会被调用，只能用于不持有其它资源的类型
+    template <typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+
+    const uint8_t* copy(const void *src, size_t len)
+    {
+        auto dst = (uint8_t*) alloc(len, 1);
+        if (dst) memcpy(dst, src, len);
+        return dst;
+    }
+
+
+    size_t used() { return m_used; }
+
+    size_t reserved() { return m_reserved; }
+};
+
+};
+
+#endif
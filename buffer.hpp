@@ -0,0 +1,76 @@
+
+
+#ifndef _CSF_BUFFER_HPP
+#define _CSF_BUFFER_HPP
+
+
+#include "global.hpp"
+
+
+namespace csf
+{
+
+// 可复用的字节缓冲区，避免每次转码都 new 一块内存
+class buffer
+{
+private:
+    char *m_data;
+    size_t m_size;
+    size_t m_capacity;
+
+public:
+
+    buffer() : m_data(nullptr), m_size(0), m_capacity(0) { }
+
+    buffer(const buffer&) = delete;
+    buffer& operator=(const buffer&) = delete;
+
+    ~buffer() { free(m_data); m_data = nullptr; }
+
+
+    // 保证末尾至少还有 n 个字节可写，返回可写位置
+    char* reserve(size_t n)
+    {
+        if (m_size + n > m_capacity) {
+            size_t capacity = m_capacity < 256 ? 256 : m_capacity;
+            while (capacity < m_size + n) capacity <<= 1;
+
+            auto data = (char*) realloc(m_data, capacity);
+            abort_if(data == nullptr, "out of memory, buffer size %lu\n", (unsigned long) capacity);
+            m_data = data;
+            m_capacity = capacity;
+        }
+        return m_data + m_size;
+    }
+
+
+    // 确认 reserve 之后实际写入的字节数
+    void commit(size_t n) { m_size += n; }
+
+
+    void append(const void *src, size_t len)
+    {
+        memcpy(reserve(len), src, len);
+        m_size += len;
+    }
+
+
+    void clear() { m_size = 0; }
+
+
+    char* data() { return m_data; }
+
+    size_t size() { return m_size; }
+
+
+    // 以 '\0' 结尾，但 '\0' 不计入 size
+    const char* c_str()
+    {
+        *reserve(1) = '\0';
+        return m_data;
+    }
+};
+
+};
+
+#endif
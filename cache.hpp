@@ -0,0 +1,233 @@
+
+
+#ifndef _CSF_CACHE_HPP
+#define _CSF_CACHE_HPP
+
+
+#include "csf.hpp"
+#include "parallel.hpp"
+#include <vector>
+
+
+namespace csf
+{
+
+// .csf 的 sidecar 缓存 (FILE.cache)，保存每个 label 在文件中的位置和 label hash 表的 slots。
+// 源文件的 stamp 与缓存一致时，打开文件不再扫描 label 和 string，也不逐个插入 hash 表：
+// 映射两个文件，拷贝 slots，再顺序创建 lazy 的 label，不读取源文件中 label 的内容。
+// stamp 是大小、修改时间、状态改变时间、inode 和文件开头 4KB 的 hash，命中时的开销与文件大小无关。
+// verify 时再校验整个文件的内容 hash 和每个 label 的 magic，开销与文件大小成正比。
+// 任何一项不一致或者缓存损坏都视为未命中，由调用者重新加载并重建缓存
+//
+//   magic, version                  u32 x 2
+//   size, mtime_sec, mtime_nsec     u64 x 3     源文件
+//   ctime_sec, ctime_nsec, ino      u64 x 3
+//   head_hash                       u64         源文件开头 HEAD_SIZE 字节的 hash
+//   content_hash                    u64         源文件内容的 hash，见 content_hash
+//   label_num, capacity             u32 x 2
+//   label_span x label_num
+//   hashmap_slot x capacity
+//   body_hash                       u64         上面两个数组的 hash，见 body_hash
+class csf_cache
+{
+private:
+    static const uint32_t MAGIC = 0x58465343;       // "CSFX"
+    static const uint32_t VERSION = 2;
+
+    static const size_t HEADER_SIZE = 4 * 2 + 8 * 8 + 4 * 2;
+    static const size_t HEAD_SIZE = 4096;
+
+    csf_cache() = delete;
+
+
+    struct stamp
+    {
+        uint64_t size;
+        uint64_t sec;
+        uint64_t nsec;
+        uint64_t ctime_sec;
+        uint64_t ctime_nsec;
+        uint64_t ino;
+    };
+
+    static bool get_stamp(const char *name, stamp *st)
+    {
+        struct stat s;
+        if (stat(name, &s) != 0) {
+            return false;
+        }
+        st->size = s.st_size;
+        st->sec = s.st_mtime;
+        st->ctime_sec = s.st_ctime;
+#ifdef _WIN32
+        st->nsec = 0;
+        st->ctime_nsec = 0;
+        st->ino = 0;
+#else
+        st->nsec = s.st_mtim.tv_nsec;
+        st->ctime_nsec = s.st_ctim.tv_nsec;
+        st->ino = s.st_ino;
+#endif
+        return true;
+    }
+
+
+    // 每 4MB 分别计算 hash64 再合并，各段可以并行，校验整个文件时只受内存带宽限制
+    static uint64_t content_hash(const uint8_t *data, size_t size)
+    {
+        static const size_t CHUNK = 4 << 20;
+
+        const size_t n = (size + CHUNK - 1) / CHUNK;
+        std::vector<uint64_t> hashes(n + 1, 0);
+        hashes[n] = size;
+        parallel::for_range(n, parallel::threads_for(n, 2), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; i++) {
+                size_t len = i + 1 < n ? CHUNK : size - i * CHUNK;
+                hashes[i] = string_utils::hash64(data + i * CHUNK, len);
+            }
+        });
+        return string_utils::hash64(hashes.data(), hashes.size() * sizeof(uint64_t));
+    }
+
+
+    // 原地改写文件开头 (例如文件头) 但保留修改时间的情况由它发现
+    static uint64_t head_hash(const uint8_t *data, size_t size)
+    {
+        return string_utils::hash64(data, size < HEAD_SIZE ? size : HEAD_SIZE);
+    }
+
+
+    static uint64_t body_hash(const label_span *spans, size_t n, const hashmap_slot *slots, size_t capacity)
+    {
+        uint64_t h = string_utils::hash64(spans, n * sizeof(label_span));
+        return string_utils::hash64(slots, capacity * sizeof(hashmap_slot), h);
+    }
+
+
+    // 只用缓存中的数据校验记录的范围，保证之后 assign_raw 不会越界，不访问源文件的内容。
+    // verify 时再逐个检查源文件中 label 的 magic 和名称长度
+    static bool check_spans(const label_span *spans, size_t n, const uint8_t *data, size_t size, bool verify)
+    {
+        for (size_t i = 0; i < n; i++) {
+            const label_span& s = spans[i];
+            if (s.offset > size || s.len > size - s.offset || ! csf_label::check_span(s.len, s.name_len)) {
+                return false;
+            }
+            if (verify && ! csf_label::check_raw(data + s.offset, s.len, s.name_len)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+
+    static std::string path_of(const char *csf_name)
+    {
+        return std::string(csf_name) + ".cache";
+    }
+
+
+    // 命中时返回按缓存加载的 csf_file，否则返回 nullptr。verify 时校验整个文件的内容 hash
+    static csf_file* load(const char *csf_name, bool verify = false)
+    {
+        stamp st;
+        if (! get_stamp(csf_name, &st) || access(path_of(csf_name).c_str(), R_OK) != 0) {
+            return nullptr;
+        }
+
+        try {
+            file_reader c(path_of(csf_name).c_str());
+            const size_t cache_size = c.source()->size();
+            if (cache_size < HEADER_SIZE) {
+                return nullptr;
+            }
+            if (c.read_int() != MAGIC || c.read_int() != VERSION) {
+                return nullptr;
+            }
+            if (c.read_long() != st.size || c.read_long() != st.sec || c.read_long() != st.nsec) {
+                return nullptr;
+            }
+            if (c.read_long() != st.ctime_sec || c.read_long() != st.ctime_nsec || c.read_long() != st.ino) {
+                return nullptr;
+            }
+            const uint64_t head = c.read_long();
+            const uint64_t hash = c.read_long();
+            const size_t n = c.read_int();
+            const size_t capacity = c.read_int();
+            const size_t body = n * sizeof(label_span) + capacity * sizeof(hashmap_slot);
+            if (n > INT32_MAX || capacity > INT32_MAX || cache_size - HEADER_SIZE != body + 8) {
+                return nullptr;
+            }
+
+            auto spans = (const label_span*) c.read_view(n * sizeof(label_span));
+            auto slots = (const hashmap_slot*) c.read_view(capacity * sizeof(hashmap_slot));
+            if (c.read_long() != body_hash(spans, n, slots, capacity)) {
+                return nullptr;
+            }
+
+            file_reader r(csf_name);
+            const uint8_t *data = r.source()->data();
+            const size_t size = r.source()->size();
+            if (size != st.size || head_hash(data, size) != head) {
+                return nullptr;
+            }
+            // 修改时间和 inode 都可能被保留，verify 时以全部内容为准
+            if (verify && content_hash(data, size) != hash) {
+                return nullptr;
+            }
+            if (! check_spans(spans, n, data, size, verify)) {
+                return nullptr;
+            }
+
+            std::unique_ptr<csf_file> file(new csf_file());
+            if (! file->read_from_index(r, spans, n, slots, (int) capacity)) {
+                return nullptr;
+            }
+            return file.release();
+        }
+        catch (const csf::error&) {
+            return nullptr;
+        }
+    }
+
+
+    // 为刚从 csf_name 加载、还没有修改过的 file 写入缓存
+    static void store(csf_file& file, const char *csf_name)
+    {
+        std::vector<label_span> spans;
+        const hashmap_slot *slots;
+        int capacity;
+        abort_if(! file.export_index(spans, &slots, &capacity), "can't cache %s, it has been modified\n", csf_name);
+
+        stamp st;
+        abort_if(! get_stamp(csf_name, &st), "can't stat file %s\n", csf_name);
+
+        // 以映射的内容为准，stat 之后文件又被修改时 ctime 或内容 hash 不会匹配，下次打开时重建
+        std::shared_ptr<mapped_file> source = file.source();
+        abort_if(source->size() != st.size, "file %s changed while caching\n", csf_name);
+
+        const std::string name = path_of(csf_name);
+        file_writer w(name.c_str());
+        w.write_bytes(MAGIC);
+        w.write_bytes(VERSION);
+        w.write_bytes(st.size);
+        w.write_bytes(st.sec);
+        w.write_bytes(st.nsec);
+        w.write_bytes(st.ctime_sec);
+        w.write_bytes(st.ctime_nsec);
+        w.write_bytes(st.ino);
+        w.write_bytes(head_hash(source->data(), source->size()));
+        w.write_bytes(content_hash(source->data(), source->size()));
+        w.write_bytes((uint32_t) spans.size());
+        w.write_bytes((uint32_t) capacity);
+        w.write_bytes(spans.data(), spans.size() * sizeof(label_span));
+        w.write_bytes(slots, capacity * sizeof(hashmap_slot));
+        w.write_bytes(body_hash(spans.data(), spans.size(), slots, capacity));
+        w.commit();
+    }
+};
+
+};
+
+#endif
@@ -12,9 +12,8 @@ namespace csf
 class cmdline
 {
 private:
-    static const uint32_t MAX_BUFF_LEN = 2047;
-
-    unsigned char m_buff[MAX_BUFF_LEN + 1]; // [1]
+    unsigned char *m_buff; // [1]
+    int m_buff_capacity;
     int m_buff_len, m_buff_offset;
     int m_next_len;
 
@@ -23,22 +22,68 @@ private:
     // 如果是 char[]，遇到非 ascii 字符时，m_buff[i] 可能 < 0
     // 从而判断失败
 
+    // [2] 缓冲区按需增长，一行的长度没有限制；
+    // has_next 会在 token 末尾写入 '\0'，因此总是多留一个字节
+
+
+    void reserve(int len)
+    {
+        if (len + 1 <= m_buff_capacity) {
+            return;
+        }
+        int capacity = m_buff_capacity;
+        while (capacity < len + 1) capacity <<= 1;
+
+        auto buff = (unsigned char*) realloc(m_buff, capacity);
+        abort_if(buff == nullptr, "out of memory, line length %d\n", len);
+        m_buff = buff;
+        m_buff_capacity = capacity;
+    }
+
 public:
 
-    cmdline() : m_buff_len(0), m_buff_offset(0), m_next_len(0) 
+    cmdline() : m_buff_capacity(256), m_buff_len(0), m_buff_offset(0), m_next_len(0) 
     { 
+        m_buff = (unsigned char*) malloc(m_buff_capacity);
+        abort_if(m_buff == nullptr, "out of memory\n");
         m_buff[0] = '\0'; 
     }
 
+    cmdline(const cmdline&) = delete;
+    cmdline& operator=(const cmdline&) = delete;
+
+    ~cmdline() { free(m_buff); m_buff = nullptr; }
 
-    int read_line()
-    {
-        fgets((char*) m_buff, MAX_BUFF_LEN, stdin);
 
+    // 读取完整的一行 [2]，没有读到任何内容时返回非 0
+    int read_line(FILE *fp = stdin)
+    {
         m_buff_offset = 0;
-        m_buff_len = strlen((char*) m_buff);
+        m_buff_len = 0;
+        m_buff[0] = '\0';
+
+        while (fgets((char*) m_buff + m_buff_len, m_buff_capacity - m_buff_len, fp)) {
+            m_buff_len += strlen((char*) m_buff + m_buff_len);
+            if (m_buff_len > 0 && m_buff[m_buff_len - 1] == '\n') {
+                break;
+            }
+            reserve(m_buff_capacity);
+        }
+
+        return m_buff_len == 0 && (feof(fp) || ferror(fp));
+    }
+
 
-        return feof(stdin) || ferror(stdin);
+    // 直接使用给定的内容作为一行，用于 -c 参数
+    void set_line(const char *line, int len)
+    {
+        reserve(len);
+        memcpy(m_buff, line, len);
+        m_buff[len] = '\0';
+
+        m_buff_offset = 0;
+        m_buff_len = len;
+        m_next_len = 0;
     }
 
 
@@ -7,26 +7,229 @@
 #include "header.hpp"
 #include "label.hpp"
 #include "string_utils.hpp"
+#include "search.hpp"
+#include "parallel.hpp"
+#include <algorithm>
 
 namespace csf
 {
 
-class csf_file
+// 一个没有修改过的 label 在文件中的位置，用于 sidecar 缓存
+struct label_span
+{
+    uint32_t offset;
+    uint32_t len;
+    uint32_t strings;
+    uint32_t name_len;
+};
+
+
+class csf_file : public label_listener
 {
 private:
     csf_header m_header;
     hashmap m_labels;
 
+    // label、string 对象以及被编辑过的名称和内容都分配在这里，随 csf_file 一起释放。
+    // 被替换或删除的 label 不单独释放，关闭文件时整体归还
+    arena m_arena;
+
+    // 编辑和导入的内容经过这里去重后存放在 m_arena 中
+    intern_pool m_pool;
+
+    // 并行加载时每个线程各自使用的 arena，其中的 label 之后的编辑也分配在这里
+    std::vector<std::unique_ptr<arena>> m_load_arenas;
+
+    // label 和 string 是映射文件的视图，必须保证其生命周期
+    std::shared_ptr<mapped_file> m_source;
+
+    // overlay 叠加的只读层，其中的 label 直接放在 m_labels 中，层本身只负责保持映射和 arena。
+    // m_whiteouts 是本次会话中删除的名称，之后叠加的层不会让它们重新出现。
+    // 以被删除的 label 的 key 为键，label 不会被释放，不拷贝名称；第一次删除时才建立
+    std::vector<std::unique_ptr<csf_file>> m_layers;
+    hashmap m_whiteouts;
+    bool m_has_whiteouts = false;
+
+    // 按名称排序的二级索引，第一次范围查询时才建立。
+    // 少量 insert/remove 直接在数组上增删，批量修改时只标记失效，下次查询再整体重建
+    static const int MAX_INDEX_UPDATES = 64;
+
+    std::vector<csf_label*> m_sorted;
+    bool m_sorted_valid = false;
+    int m_sorted_updates = 0;
+
+    // 全文索引，第一次 search 时才建立，之后由 put/remove 和 label 的通知维护
+    std::unique_ptr<text_index> m_text_index;
+
+    // 自上次加载或保存以来是否有修改，没有修改时不需要保存
+    bool m_dirty = false;
+
 public:
+    // 一次 put/remove 前后的 label，不存在时为 nullptr。
+    // label 从不单独释放，记录指针就是一个完整的快照，不需要拷贝内容
+    struct delta
+    {
+        csf_label *before;
+        csf_label *after;
+    };
 
-    csf_file()
+private:
+    struct step
+    {
+        size_t end;             // 在 m_history 中的结束位置
+        std::string desc;
+    };
+
+    // 编辑历史，每个 step 是一条命令产生的全部 delta。
+    // m_applied 之前的 step 已经生效，之后的是可以 redo 的，有新的修改时被丢弃。
+    // 加载文件和 undo/redo 本身不记录
+    std::vector<delta> m_history;
+    std::vector<step> m_steps;
+    size_t m_applied = 0;
+    bool m_recording = true;
+
+
+    static int compare_name(csf_label *label, const char *name, size_t len)
+    {
+        const str_view *k = label->key();
+        int ret = memcmp(k->ptr, name, k->len < len ? k->len : len);
+        if (ret != 0) return ret;
+        return k->len < len ? -1 : k->len > len ? 1 : 0;
+    }
+
+    static bool less_label(csf_label *a, csf_label *b)
+    {
+        return compare_name(a, b->key()->ptr, b->key()->len) < 0;
+    }
+
+    // 第一个名称不小于 name 的位置
+    int lower_bound(const char *name, size_t len)
+    {
+        auto it = std::lower_bound(m_sorted.begin(), m_sorted.end(), (csf_label*) nullptr,
+            [=](csf_label *a, csf_label*) { return compare_name(a, name, len) < 0; });
+        return it - m_sorted.begin();
+    }
+
+    void index_update()
+    {
+        if (m_sorted_valid && ++ m_sorted_updates > MAX_INDEX_UPDATES) {
+            m_sorted_valid = false;
+        }
+    }
+
+    // old 是被替换掉的同名 label，为 nullptr 表示新增
+    void index_put(csf_label *label, csf_label *old)
+    {
+        index_update();
+        if (! m_sorted_valid) {
+            return;
+        }
+        const str_view *k = label->key();
+        int i = lower_bound(k->ptr, k->len);
+        if (old != nullptr) {
+            m_sorted[i] = label;
+        } else {
+            m_sorted.insert(m_sorted.begin() + i, label);
+        }
+    }
+
+    void index_remove(csf_label *label)
+    {
+        index_update();
+        if (! m_sorted_valid) {
+            return;
+        }
+        const str_view *k = label->key();
+        m_sorted.erase(m_sorted.begin() + lower_bound(k->ptr, k->len));
+    }
+
+    // 预先为 n 个新 label 扩容 hash 表，n 只是提示，失败时留给 put 逐步扩容
+    void reserve(size_t n)
+    {
+        if (n > 0 && n < (size_t) INT32_MAX - m_labels.size) {
+            hashmap_reserve(&m_labels, m_labels.size + (int) n);
+        }
+    }
+
+    void record(csf_label *before, csf_label *after)
+    {
+        if (! m_recording || before == after) {
+            return;
+        }
+        if (m_steps.size() > m_applied) {
+            m_history.resize(m_applied > 0 ? m_steps[m_applied - 1].end : 0);
+            m_steps.resize(m_applied);
+        }
+        m_history.push_back({ before, after });
+    }
+
+    size_t step_begin() { return m_applied > 0 ? m_steps[m_applied - 1].end : 0; }
+
+    void put(csf_label *label)
+    {
+        if (m_has_whiteouts && m_whiteouts.size > 0) {
+            hashmap_remove(&m_whiteouts, label->key(), nullptr);
+        }
+        auto old = (csf_label*) hashmap_put(&m_labels, label->key(), label, nullptr);
+        record(old, label);
+        index_put(label, old);
+        label->set_listener(this);
+        if (m_text_index) {
+            if (old) m_text_index->remove(old);
+            m_text_index->add(label);
+        }
+        m_dirty = true;
+    }
+
+    csf_label* erase(const str_view *key)
+    {
+        auto label = (csf_label *) hashmap_remove(&m_labels, key, nullptr);
+        if (label != nullptr) {
+            index_remove(label);
+            if (m_text_index) m_text_index->remove(label);
+            m_dirty = true;
+        }
+        return label;
+    }
+
+    void add_whiteout(const str_view *key)
+    {
+        if (! m_has_whiteouts) {
+            hashmap_options ops = {
+                .capacity = 16,
+                .load_factor = 0.75f,
+                .access_order = 0,
+                .hash = (int (*)(const void*)) string_utils::hash_view,
+                .cmp = (int (*)(const void*, const void*)) string_utils::compare_view,
+            };
+            hashmap_setup(&m_whiteouts, &ops);
+            m_has_whiteouts = true;
+        }
+        hashmap_put(&m_whiteouts, key, key, nullptr);
+    }
+
+    // undo/redo 时把 name 恢复为 label，nullptr 表示删除
+    void restore(const str_view *name, csf_label *label, bool whiteout)
+    {
+        if (label != nullptr) {
+            put(label);
+            return;
+        }
+        if (erase(name) != nullptr && whiteout) {
+            add_whiteout(name);
+        }
+    }
+
+public:
+
+    csf_file() : m_pool(m_arena)
     {
         hashmap_options ops = {
             .capacity = 1024 * 8,
             .load_factor = 0.75f,
             .access_order = 0,
-            .hash = (int (*)(const void*)) string_utils::hash,
-            .cmp = (int (*)(const void*, const void*)) ::strcmp,
+            .hash = (int (*)(const void*)) string_utils::hash_view,
+            .cmp = (int (*)(const void*, const void*)) string_utils::compare_view,
         };
         hashmap_setup(&m_labels, &ops);
     }
@@ -36,19 +239,72 @@ public:
 
     ~csf_file()
     {
-        int n = 0;
-        auto labels = (csf_label**) hashmap_values(&m_labels, &n);
-        for (int i = 0; i < n; i++) {
-            delete labels[i];
-        }
-        free(labels);
         hashmap_destroy(&m_labels);
+        if (m_has_whiteouts) hashmap_destroy(&m_whiteouts);
     }
 
 
     int size() { return m_labels.size; }
 
 
+    void on_label_changed(csf_label *label) override
+    {
+        m_dirty = true;
+        if (m_text_index) m_text_index->on_label_changed(label);
+    }
+
+
+    bool is_dirty() { return m_dirty; }
+
+    // 内容已经写入当前的文件
+    void set_clean() { m_dirty = false; }
+
+
+    arena& get_arena() { return m_arena; }
+
+    intern_pool& get_pool() { return m_pool; }
+
+    csf_header& get_header() { return m_header; }
+
+    // 加载时映射的源文件，没有从文件加载时为空
+    std::shared_ptr<mapped_file> source() { return m_source; }
+
+
+    // 所有 arena 已分配和向系统申请的字节数
+    void memory(size_t *p_used, size_t *p_reserved)
+    {
+        size_t used = m_arena.used(), reserved = m_arena.reserved();
+        for (auto& a : m_load_arenas) {
+            used += a->used();
+            reserved += a->reserved();
+        }
+        for (auto& layer : m_layers) {
+            size_t u = 0, r = 0;
+            layer->memory(&u, &r);
+            used += u;
+            reserved += r;
+        }
+        *p_used = used;
+        *p_reserved = reserved;
+    }
+
+
+    void stats(hashmap_stat *stat) { hashmap_stats(&m_labels, stat); }
+
+
+    // 还没有创建 string 的 label 数量
+    int lazy_count()
+    {
+        int n = 0, count = 0;
+        auto labels = (csf_label**) hashmap_values(&m_labels, &n);
+        for (int i = 0; i < n; i++) {
+            count += labels[i]->is_lazy();
+        }
+        free(labels);
+        return count;
+    }
+
+
     csf_label** children(int *p_size) 
     {
         // 包裹一层，这样外部类就能通过 delete[] 释放内存
@@ -66,63 +322,397 @@ public:
 
     csf_label* find(const char *name)
     {
-        return (csf_label *) hashmap_get(&m_labels, name);
+        return find(name, strlen(name));
+    }
+
+    csf_label* find(const char *name, size_t len)
+    {
+        str_view key = { name, len };
+        return (csf_label *) hashmap_get(&m_labels, &key);
     }
 
     void remove(const char *name)
     {
-        auto label = (csf_label *) hashmap_remove(&m_labels, name, nullptr);
-        delete label;
+        remove(name, strlen(name));
+    }
+
+    void remove(const char *name, size_t len)
+    {
+        str_view key = { name, len };
+        if (auto label = erase(&key)) {
+            record(label, nullptr);
+            add_whiteout(label->key());
+        }
     }
 
     void insert(csf_label *label)
     {
         // 创建一个副本
-        label = new csf_label(*label);
+        put(m_arena.create<csf_label>(*label, &m_arena));
+    }
+
+    // 接管 label 的内容，不拷贝 string；label 来自其它 arena 时只能拷贝到当前文件中
+    void insert(csf_label&& label)
+    {
+        if (label.get_arena() == &m_arena) {
+            put(m_arena.create<csf_label>(std::move(label)));
+        } else {
+            put(m_arena.create<csf_label>(label, &m_arena));
+        }
+    }
+
+    void insert(std::unique_ptr<csf_label> label)
+    {
+        insert(std::move(*label));
+    }
+
+    // 直接在 csf_file 中创建一个空的 label，同名的旧 label 被替换
+    csf_label* emplace(const char *name, size_t len)
+    {
+        csf_label *label = m_arena.create<csf_label>(&m_arena);
+        label->set_name(name, len);
+        put(label);
+        return label;
+    }
+
+    // 把 layer 叠加在当前内容之上。layer 中的 label 直接放入 hash 表，不拷贝 label 和 string，
+    // layer 交给当前文件持有，保存时与其它没有修改过的 label 一样从映射中原样写出。
+    // 本次会话中新建、修改过的 label 和删除的名称属于最上面的可写层，不会被 layer 覆盖。
+    // 叠加与加载文件一样不进入编辑历史，之前的历史被清空：layer 一直由当前文件持有，
+    // 撤销叠加或者跨过叠加撤销之前的修改都无法得到一致的结果，也不需要为每个 label 记录 delta。
+    // 返回叠加上去的 label 数，p_replaced 为其中替换掉同名 label 的数量
+    int overlay(std::unique_ptr<csf_file> layer, int *p_replaced = nullptr)
+    {
+        int n = 0, count = 0, replaced = 0;
+        auto labels = (csf_label**) hashmap_values(&layer->m_labels, &n);
+        reserve(n);
+
+        m_recording = false;
+
+        for (int i = 0; i < n; i++) {
+            const str_view *k = labels[i]->key();
+            if (m_has_whiteouts && m_whiteouts.size > 0 && hashmap_get(&m_whiteouts, k) != nullptr) {
+                continue;
+            }
+
+            const uint8_t *raw;
+            uint32_t len;
+            auto old = (csf_label*) hashmap_get(&m_labels, k);
+            if (old != nullptr && ! old->raw_span(&raw, &len)) {
+                continue;
+            }
+            put(labels[i]);
+            count ++;
+            replaced += old != nullptr;
+        }
+        free(labels);
+        m_recording = true;
+        clear_history();
+
+        m_layers.push_back(std::move(layer));
+        if (p_replaced) *p_replaced = replaced;
+        return count;
+    }
+
+    int layer_num() { return (int) m_layers.size(); }
 
-        // printf("[insert after][%p]\n", label);
 
-        auto old = (csf_label*) hashmap_put(&m_labels, label->name(), label, nullptr);
-        delete old;
+    // 把上一个 step 之后的修改合并为一个 step，没有修改时返回 false。
+    // p_deltas 不为空时拷贝这个 step 的全部 delta
+    bool commit_step(const char *desc, std::vector<delta> *p_deltas = nullptr)
+    {
+        const size_t begin = step_begin();
+        if (m_steps.size() > m_applied || m_history.size() == begin) {
+            return false;
+        }
+        m_steps.push_back({ m_history.size(), desc });
+        m_applied ++;
+        if (p_deltas) p_deltas->assign(m_history.begin() + begin, m_history.end());
+        return true;
+    }
+
+    // 撤销最近一个生效的 step，返回它的描述，没有可以撤销的 step 时返回 nullptr。
+    // p_applied 中是实际执行的修改，按执行的顺序。删除后恢复的 label 排在最后
+    const char* undo(std::vector<delta> *p_applied = nullptr)
+    {
+        commit_step("edit");
+        if (m_applied == 0) {
+            return nullptr;
+        }
+        m_applied --;
+        const size_t begin = step_begin(), end = m_steps[m_applied].end;
+
+        if (p_applied) p_applied->clear();
+        m_recording = false;
+        for (size_t i = end; i-- > begin; ) {
+            const delta& d = m_history[i];
+            restore((d.before ? d.before : d.after)->key(), d.before, false);
+            if (p_applied) p_applied->push_back({ d.after, d.before });
+        }
+        m_recording = true;
+        return m_steps[m_applied].desc.c_str();
+    }
+
+    // 重新执行最近一个撤销的 step，没有时返回 nullptr
+    const char* redo(std::vector<delta> *p_applied = nullptr)
+    {
+        if (m_applied == m_steps.size()) {
+            return nullptr;
+        }
+        const size_t begin = step_begin(), end = m_steps[m_applied].end;
+
+        if (p_applied) p_applied->clear();
+        m_recording = false;
+        for (size_t i = begin; i < end; i++) {
+            const delta& d = m_history[i];
+            restore((d.before ? d.before : d.after)->key(), d.after, true);
+            if (p_applied) p_applied->push_back(d);
+        }
+        m_recording = true;
+        return m_steps[m_applied ++].desc.c_str();
+    }
+
+    // 丢弃全部编辑历史，之前的修改不再能够撤销
+    void clear_history()
+    {
+        std::vector<delta>().swap(m_history);
+        std::vector<step>().swap(m_steps);
+        m_applied = 0;
+    }
+
+    int undo_num() { return (int) m_applied; }
+
+    int redo_num() { return (int) (m_steps.size() - m_applied); }
+
+
+    // 按名称排序的全部 label，返回的数组在下一次修改之前有效
+    csf_label** sorted(int *p_size)
+    {
+        if (! m_sorted_valid) {
+            int n = 0;
+            auto labels = (csf_label**) hashmap_values(&m_labels, &n);
+            m_sorted.assign(labels, labels + n);
+            free(labels);
+
+            std::sort(m_sorted.begin(), m_sorted.end(), less_label);
+            m_sorted_valid = true;
+            m_sorted_updates = 0;
+        }
+        if (p_size) *p_size = m_sorted.size();
+        return m_sorted.data();
+    }
+
+    // 名称在 [from, to) 中的 label 在 sorted() 中的下标范围，to 为 nullptr 表示不限
+    void range(const char *from, const char *to, int *p_first, int *p_last)
+    {
+        int n = 0;
+        sorted(&n);
+        *p_first = from ? lower_bound(from, strlen(from)) : 0;
+        *p_last = to ? lower_bound(to, strlen(to)) : n;
+        if (*p_last < *p_first) *p_last = *p_first;
     }
 
-    void read_from_file(file_reader& r)
+    // 以 prefix 开头的 label 的下标范围
+    void prefix_range(const char *prefix, int *p_first, int *p_last)
     {
+        const size_t len = strlen(prefix);
+        int n = 0;
+        csf_label **labels = sorted(&n);
+
+        int i = lower_bound(prefix, len);
+        int j = i;
+        while (j < n && labels[j]->key()->len >= len && memcmp(labels[j]->key()->ptr, prefix, len) == 0) {
+            j++;
+        }
+        *p_first = i;
+        *p_last = j;
+    }
+
+
+    text_index& get_text_index()
+    {
+        if (! m_text_index) {
+            m_text_index.reset(new text_index());
+
+            int n = 0;
+            auto labels = (csf_label**) hashmap_values(&m_labels, &n);
+            for (int i = 0; i < n; i++) {
+                m_text_index->add(labels[i]);
+            }
+            free(labels);
+        }
+        return *m_text_index;
+    }
+
+
+    // 分两步加载：先顺序扫描出每个 label 的偏移，再把创建对象的工作分给多个线程，
+    // 最后按文件中的顺序放入 m_labels，同名 label 的覆盖顺序与单线程一致。
+    // label 和 string 都是映射文件的视图，解析时不涉及 m_arena，各线程之间没有共享的写入。
+    //
+    // lazy 为 true 时每个 label 只记录原始字节的范围，扫描本身就是全部的工作，不再分线程
+    void read_from_file(file_reader& r, bool lazy = false)
+    {
+        static const size_t MIN_CHUNK = 4096;
+
+        m_source = r.source();
         m_header.read_from_file(r);
-        for (int i = 0, n = m_header.get_label_num(); i < n; i++) {
-            csf_label *label = new csf_label();
-            label->read_from_file(r);
-            auto old = (csf_label*) hashmap_put(&m_labels, label->name(), label, nullptr);
-            delete old;
+
+        // 加载的内容不进入编辑历史，加载失败时整个 csf_file 都会被丢弃
+        m_recording = false;
+
+        const size_t n = m_header.get_label_num();
+        const int threads = lazy ? 1 : parallel::threads_for(n, MIN_CHUNK);
+
+        // label_num 来自文件，不可信，最多按每个 label 12 字节估计
+        const size_t max_labels = m_source ? m_source->size() / 12 : 0;
+        reserve(n < max_labels ? n : max_labels);
+
+        if (threads <= 1) {
+            for (size_t i = 0; i < n; i++) {
+                csf_label *label = m_arena.create<csf_label>(&m_arena);
+                label->read_from_file(r, lazy);
+                put(label);
+            }
+            m_dirty = false;
+            m_recording = true;
+            return;
+        }
+
+        std::vector<size_t> offsets(n);
+        for (size_t i = 0; i < n; i++) {
+            offsets[i] = r.where();
+            csf_label::skip(r);
+        }
+
+        // arena 不是线程安全的，每个线程使用自己的 arena，加载失败时也随 csf_file 一起释放
+        for (int t = 0; t < threads; t++) {
+            m_load_arenas.emplace_back(new arena());
+        }
+
+        std::vector<csf_label*> labels(n, nullptr);
+        parallel::for_range(n, threads, [&](size_t begin, size_t end, int part) {
+            arena *a = m_load_arenas[m_load_arenas.size() - threads + part].get();
+            file_reader reader(m_source, offsets[begin]);
+            for (size_t i = begin; i < end; i++) {
+                labels[i] = a->create<csf_label>(a);
+                labels[i]->read_from_file(reader);
+            }
+        });
+
+        for (size_t i = 0; i < n; i++) {
+            put(labels[i]);
         }
+        m_dirty = false;
+        m_recording = true;
     }
 
 
-    void write_to_file(file_writer& w)
+    // 按缓存中记录的位置创建 lazy 的 label，并用保存的 slots 直接恢复 hash 表，
+    // 不扫描文件，也不重新计算名称的 hash。spans 和 slots 必须来自 export_index，
+    // 并且源文件的内容没有变化，由调用者校验。slots 不完整时返回 false
+    bool read_from_index(file_reader& r, const label_span *spans, size_t n,
+        const hashmap_slot *slots, int capacity)
+    {
+        m_source = r.source();
+        m_header.read_from_file(r);
+
+        if (hashmap_restore(&m_labels, slots, capacity, (int) n) != 0) {
+            return false;
+        }
+
+        const uint8_t *data = m_source->data();
+        for (size_t i = 0; i < n; i++) {
+            csf_label *label = m_arena.create<csf_label>(&m_arena);
+            label->assign_raw(data + spans[i].offset, spans[i].len, spans[i].name_len, spans[i].strings);
+            label->set_listener(this);
+            m_labels.entries[i].key = label->key();
+            m_labels.entries[i].value = label;
+        }
+        m_dirty = false;
+        return true;
+    }
+
+    // 所有 label 在源文件中的位置 (按 hash 表中的顺序) 和 hash 表的 slots，
+    // 有 label 被修改过、删除过或者不来自源文件时返回 false
+    bool export_index(std::vector<label_span>& out, const hashmap_slot **p_slots, int *p_capacity)
     {
-        // 先写入 header 占位
-        const unsigned long where = w.where();
-        m_header.write_to_file(w);
-        
+        out.clear();
+        if (! m_source || m_labels.entries_len != m_labels.size) {
+            return false;
+        }
+        const uint8_t *data = m_source->data();
+        const size_t size = m_source->size();
+
+        int n = 0;
+        auto labels = (csf_label**) hashmap_values(&m_labels, &n);
+        out.reserve(n);
+        for (int i = 0; i < n; i++) {
+            const uint8_t *raw;
+            uint32_t len;
+            if (! labels[i]->raw_span(&raw, &len) || raw < data || raw + len > data + size) {
+                break;
+            }
+            label_span span = { (uint32_t) (raw - data), len, (uint32_t) labels[i]->size(),
+                (uint32_t) labels[i]->key()->len };
+            out.push_back(span);
+        }
+        free(labels);
+
+        *p_slots = m_labels.slots;
+        *p_capacity = m_labels.ops.capacity;
+        return out.size() == (size_t) n;
+    }
+
 
+    void write_to_file(file_writer& w)
+    {
         int n = 0;
         csf_label **labels = (csf_label**) hashmap_values(&m_labels, &n);
-        
-        // 遍历并写入到文件
+        write_labels(w, m_header, labels, n);
+        free(labels);
+    }
+
+
+    // 按顺序写出 labels，header 中除 label 和 string 数量之外的字段来自 header。
+    // 没有修改过的 label 直接拷贝原始字节，文件中相邻的连续区间合并为一次大块写入，
+    // 大块写入不经过 file_writer 的缓冲区，直接从映射的内存写出；只有修改过的 label 重新编码。
+    // labels 可以来自不同的 csf_file
+    static void write_labels(file_writer& w, csf_header header, csf_label **labels, int n)
+    {
+        // 先算出 string_num，header 只需写一次，不需要回头修改
         int string_num = 0;
         for (int i = 0; i < n; i++) {
-            // printf("[write_to_file][%p]\n", labels[i]);
             string_num += labels[i]->size();
-            labels[i]->write_to_file(w);
         }
-        free(labels);
+        header.set_string_num(string_num);
+        header.set_label_num(n);
+        header.write_to_file(w);
 
-        // 需要重新计算 string_num
-        w.jump(where, SEEK_SET);
+        const uint8_t *run = nullptr;
+        size_t run_len = 0;
 
-        m_header.set_string_num(string_num);
-        m_header.set_label_num(n);
-        m_header.write_to_file(w);
+        for (int i = 0; i < n; i++) {
+            const uint8_t *raw;
+            uint32_t len;
+            if (labels[i]->raw_span(&raw, &len)) {
+                if (run != nullptr && run + run_len == raw) {
+                    run_len += len;
+                    continue;
+                }
+                if (run != nullptr) w.write_bytes(run, run_len);
+                run = raw;
+                run_len = len;
+                continue;
+            }
+            if (run != nullptr) {
+                w.write_bytes(run, run_len);
+                run = nullptr;
+            }
+            labels[i]->write_to_file(w);
+        }
+        if (run != nullptr) {
+            w.write_bytes(run, run_len);
+        }
     }
 
 };
@@ -0,0 +1,245 @@
+#ifndef _CSF_DIFF_HPP
+#define _CSF_DIFF_HPP
+
+
+#include "csf.hpp"
+#include "export.hpp"
+#include <vector>
+
+
+namespace csf
+{
+
+// 比较两个 csf_file，找出新增、删除和修改的 label。
+// 同名 label 先比较文件中的原始字节，相同则不解析 string；不同时逐个比较编码后的 value 和 extra，
+// 只有确实不同的内容才解码输出。两个文件都以 lazy 方式打开时，没有变化的 label 完全不会被解析。
+//
+// 补丁是 import 可以直接读取的 JSON lines，删除的 label 在前，其余按新文件中的顺序：
+//
+//   {"op": "remove", "label": "..."}
+//   {"op": "add", "label": "...", "value": "...", "extra": "..."}
+//   {"op": "change", "label": "...", "index": 0, "value": "...", "old_value": "...", "old_extra": "..."}
+//
+// 修改的 label 列出新文件中的全部 string，只有变化的 string 带有 old_value/old_extra，
+// 被删掉的 string 只有 old_value/old_extra。import 忽略 index 和 old_* 字段，按整个 label 替换
+class csf_diff
+{
+public:
+    static const int ADDED      =   0;
+    static const int REMOVED    =   1;
+    static const int CHANGED    =   2;
+
+    struct change
+    {
+        int kind;
+        csf_label *a;       // 旧文件中的 label，新增时为 nullptr
+        csf_label *b;       // 新文件中的 label，删除时为 nullptr
+    };
+
+private:
+    std::vector<change> m_changes;
+    int m_counts[3];
+    int m_same;
+    int m_strings;          // 修改的 label 中变化的 string 数
+
+    buffer m_line;
+    buffer m_text;
+
+
+    void append(const char *s) { m_line.append(s, strlen(s)); }
+
+    void append_field(const char *key, const char *p, size_t len)
+    {
+        append(", \"");
+        append(key);
+        append("\": \"");
+        csf_exporter::escape_json(p, len, m_line);
+        append("\"");
+    }
+
+    void append_value(const char *key, csf_string *str)
+    {
+        m_text.clear();
+        str->get_value(m_text);
+        append_field(key, m_text.data(), m_text.size());
+    }
+
+    void append_extra(const char *key, csf_string *str, bool always)
+    {
+        int len = 0;
+        const char *extra = str->get_extra(&len);
+        if (extra != nullptr || always) {
+            append_field(key, extra ? extra : "", len);
+        }
+    }
+
+    void begin_line(const char *op, csf_label *label)
+    {
+        int len = 0;
+        const char *name = label->name(&len);
+
+        m_line.clear();
+        append("{\"op\": \"");
+        append(op);
+        append("\", \"label\": \"");
+        csf_exporter::escape_json(name, len, m_line);
+        append("\"");
+    }
+
+    void end_line(file_writer& w)
+    {
+        append("}\n");
+        w.write_bytes(m_line.data(), m_line.size());
+    }
+
+
+    void write_added(file_writer& w, csf_label *b)
+    {
+        const int n = b->size();
+        if (n == 0) {
+            begin_line("add", b);
+            end_line(w);
+        }
+        for (int i = 0; i < n; i++) {
+            csf_string *str = b->get(i);
+            begin_line("add", b);
+            append_value("value", str);
+            append_extra("extra", str, false);
+            end_line(w);
+        }
+    }
+
+
+    void write_changed(file_writer& w, csf_label *a, csf_label *b)
+    {
+        const int na = a->size(), nb = b->size();
+        const int n = na > nb ? na : nb;
+        char index[32];
+
+        for (int i = 0; i < n; i++) {
+            csf_string *s = i < na ? a->get(i) : nullptr;
+            csf_string *t = i < nb ? b->get(i) : nullptr;
+
+            begin_line("change", b);
+            m_line.append(index, snprintf(index, sizeof(index), ", \"index\": %d", i));
+            if (t != nullptr) {
+                append_value("value", t);
+                append_extra("extra", t, false);
+            }
+            if (s != nullptr) {
+                const bool value = t == nullptr || ! s->same_value(*t);
+                const bool extra = t == nullptr || ! s->same_extra(*t);
+                if (value) append_value("old_value", s);
+                if (extra) append_extra("old_extra", s, t != nullptr);
+                m_strings += value || extra;
+            }
+            else {
+                m_strings ++;
+            }
+            end_line(w);
+        }
+    }
+
+public:
+
+    // 内容是否相同，原始字节相同时不解析 string。名称由调用者保证相同
+    static bool same_label(csf_label *x, csf_label *y)
+    {
+        const uint8_t *rx, *ry;
+        uint32_t lx, ly;
+        if (x->raw_span(&rx, &lx) && y->raw_span(&ry, &ly) && lx == ly && memcmp(rx, ry, lx) == 0) {
+            return true;
+        }
+
+        // 原始字节不同不代表内容不同，例如 extra 为空的 STRW
+        const int n = x->size();
+        if (n != y->size()) {
+            return false;
+        }
+        for (int i = 0; i < n; i++) {
+            csf_string *s = x->get(i), *t = y->get(i);
+            if (! s->same_value(*t) || ! s->same_extra(*t)) return false;
+        }
+        return true;
+    }
+
+
+    csf_diff() : m_same(0), m_strings(0)
+    {
+        m_counts[ADDED] = m_counts[REMOVED] = m_counts[CHANGED] = 0;
+    }
+
+
+    // 从 a 到 b 的变化
+    void compare(csf_file& a, csf_file& b)
+    {
+        m_changes.clear();
+        m_counts[ADDED] = m_counts[REMOVED] = m_counts[CHANGED] = 0;
+        m_same = m_strings = 0;
+
+        int na = 0, nb = 0;
+        std::unique_ptr<csf_label*[]> la(a.children(&na));
+        std::unique_ptr<csf_label*[]> lb(b.children(&nb));
+
+        for (int i = 0; i < na; i++) {
+            int len = 0;
+            const char *name = la[i]->name(&len);
+            if (b.find(name, len) == nullptr) {
+                m_changes.push_back({ REMOVED, la[i], nullptr });
+            }
+        }
+
+        for (int i = 0; i < nb; i++) {
+            int len = 0;
+            const char *name = lb[i]->name(&len);
+            csf_label *old = a.find(name, len);
+            if (old == nullptr) {
+                m_changes.push_back({ ADDED, nullptr, lb[i] });
+            }
+            else if (! same_label(old, lb[i])) {
+                m_changes.push_back({ CHANGED, old, lb[i] });
+            }
+            else {
+                m_same ++;
+            }
+        }
+
+        for (auto& c : m_changes) {
+            m_counts[c.kind] ++;
+        }
+    }
+
+
+    void write_patch(file_writer& w)
+    {
+        m_strings = 0;
+        for (auto& c : m_changes) {
+            switch (c.kind) {
+                case REMOVED:
+                    begin_line("remove", c.a);
+                    end_line(w);
+                    break;
+                case ADDED:
+                    write_added(w, c.b);
+                    break;
+                default:
+                    write_changed(w, c.a, c.b);
+                    break;
+            }
+        }
+    }
+
+
+    const std::vector<change>& changes() { return m_changes; }
+
+    int count(int kind) { return m_counts[kind]; }
+
+    int same() { return m_same; }
+
+    // write_patch 之后才有效
+    int changed_strings() { return m_strings; }
+};
+
+};
+
+#endif
@@ -0,0 +1,298 @@
+
+
+#ifndef _CSF_EXPORT_HPP
+#define _CSF_EXPORT_HPP
+
+
+#include "csf.hpp"
+#include "buffer.hpp"
+
+
+namespace csf
+{
+
+// 把整个字符串表导出为文本，每个 string 一行 (PO 为一个条目)。
+// 所有内容先转义到可复用的 m_line 中，再整行写入 file_writer，导出过程中不再申请内存
+//
+// TSV:         LABEL<TAB>VALUE<TAB>EXTRA，转义 \t \n \r \\，可以被 import 读回
+// JSON lines:  {"label": "...", "value": "...", "extra": "..."}
+// PO:          msgctxt 为 label 名称，同一 label 的第 n 个 string 加上 "#n" 后缀
+class csf_exporter
+{
+public:
+    static const int FORMAT_TSV     =   0;
+    static const int FORMAT_JSON    =   1;
+    static const int FORMAT_PO      =   2;
+
+private:
+    file_writer& m_writer;
+    int m_format;
+
+    buffer m_value;
+    buffer m_line;
+
+    int m_label_num;
+    int m_string_num;
+
+
+    // 把 [p, end) 中不需要转义的连续片段整段拷贝，返回第一个需要转义的位置
+    template <typename F>
+    static const char* copy_plain(const char *p, const char *end, buffer& out, F need_escape)
+    {
+        const char *q = p;
+        while (q < end && ! need_escape((uint8_t) *q)) q++;
+        out.append(p, q - p);
+        return q;
+    }
+
+
+    // p 处一个非 ASCII 字符的字节数。合法的 UTF-8 返回 true，可以原样写出；
+    // 不合法的字节 (长度为 1，*p_c 为该字节) 和孤立的代理项 (WTF-8，*p_c 为代理项) 返回 false。
+    // extra 是文件中的原始字节，value 解码后可能带有孤立的代理项，都不能直接写进文本格式
+    static bool next_utf8(const char *p, const char *end, int *p_len, uint32_t *p_c)
+    {
+        int n = utf::decode_char((const uint8_t*) p, end - p, p_c);
+        if (n == 0) {
+            *p_len = 1;
+            *p_c = (uint8_t) *p;
+            return false;
+        }
+        *p_len = n;
+        return *p_c < 0xD800 || *p_c >= 0xE000;
+    }
+
+    static void append_hex(buffer& out, const char *prefix, uint32_t c, int digits)
+    {
+        static const char HEX[] = "0123456789abcdef";
+        out.append(prefix, strlen(prefix));
+        char *dst = out.reserve(digits);
+        for (int i = digits - 1; i >= 0; i--, c >>= 4) {
+            dst[i] = HEX[c & 0xF];
+        }
+        out.commit(digits);
+    }
+
+
+    static void append_octal(buffer& out, uint8_t c)
+    {
+        char *dst = out.reserve(4);
+        dst[0] = '\\';
+        dst[1] = (char) ('0' + (c >> 6));
+        dst[2] = (char) ('0' + ((c >> 3) & 7));
+        dst[3] = (char) ('0' + (c & 7));
+        out.commit(4);
+    }
+
+
+    // 不合法的 UTF-8 和代理项按字节写成 \xHH，import 读回同样的字节
+    static void escape_tsv(const char *p, size_t len, buffer& out)
+    {
+        const char *end = p + len;
+        while ((p = copy_plain(p, end, out, [](uint8_t c) {
+            return c == '\t' || c == '\n' || c == '\r' || c == '\\' || c >= 0x80; })) < end) {
+
+            if ((uint8_t) *p >= 0x80) {
+                int n;
+                uint32_t c;
+                if (next_utf8(p, end, &n, &c)) {
+                    out.append(p, n);
+                } else {
+                    for (int i = 0; i < n; i++) append_hex(out, "\\x", (uint8_t) p[i], 2);
+                }
+                p += n;
+                continue;
+            }
+
+            switch (*p++) {
+                case '\t':  out.append("\\t", 2); break;
+                case '\n':  out.append("\\n", 2); break;
+                case '\r':  out.append("\\r", 2); break;
+                default:    out.append("\\\\", 2); break;
+            }
+        }
+    }
+
+
+    // JSON 与 PO 共用的 C 风格转义，其余控制字符 JSON 写成 \u00XX，PO 写成八进制。
+    // 孤立的代理项 JSON 写成 \uXXXX，import 读回同样的内容；不合法的字节 JSON 只能按 Latin-1 写成 \u00XX。
+    // PO 中两者都按字节写成八进制，保留原始字节
+    static void escape_c(const char *p, size_t len, buffer& out, bool json)
+    {
+        const char *end = p + len;
+
+        while ((p = copy_plain(p, end, out, [](uint8_t c) {
+            return c < 0x20 || c == '"' || c == '\\' || c >= 0x80; })) < end) {
+
+            if ((uint8_t) *p >= 0x80) {
+                int n;
+                uint32_t c;
+                if (next_utf8(p, end, &n, &c)) {
+                    out.append(p, n);
+                } else if (json) {
+                    append_hex(out, "\\u", c, 4);
+                } else {
+                    for (int i = 0; i < n; i++) append_octal(out, (uint8_t) p[i]);
+                }
+                p += n;
+                continue;
+            }
+
+            uint8_t c = (uint8_t) *p++;
+            switch (c) {
+                case '"':   out.append("\\\"", 2); break;
+                case '\\':  out.append("\\\\", 2); break;
+                case '\n':  out.append("\\n", 2); break;
+                case '\r':  out.append("\\r", 2); break;
+                case '\t':  out.append("\\t", 2); break;
+                default:
+                    if (json) append_hex(out, "\\u", c, 4);
+                    else append_octal(out, c);
+                    break;
+            }
+        }
+    }
+
+    void append(const char *s) { m_line.append(s, strlen(s)); }
+
+    void flush_line()
+    {
+        m_writer.write_bytes(m_line.data(), m_line.size());
+        m_line.clear();
+    }
+
+
+    void export_tsv(const char *name, int name_len, csf_string *str)
+    {
+        int extra_len = 0;
+        const char *extra = str->get_extra(&extra_len);
+
+        escape_tsv(name, name_len, m_line);
+        m_line.append("\t", 1);
+        escape_tsv(m_value.data(), m_value.size(), m_line);
+        if (extra != nullptr) {
+            m_line.append("\t", 1);
+            escape_tsv(extra, extra_len, m_line);
+        }
+        m_line.append("\n", 1);
+    }
+
+
+    void export_json(const char *name, int name_len, csf_string *str)
+    {
+        append("{\"label\": \"");
+        escape_c(name, name_len, m_line, true);
+        if (str != nullptr) {
+            int extra_len = 0;
+            const char *extra = str->get_extra(&extra_len);
+
+            append("\", \"value\": \"");
+            escape_c(m_value.data(), m_value.size(), m_line, true);
+            if (extra != nullptr) {
+                append("\", \"extra\": \"");
+                escape_c(extra, extra_len, m_line, true);
+            }
+        }
+        append("\"}\n");
+    }
+
+
+    void export_po(const char *name, int name_len, int idx, csf_string *str)
+    {
+        int extra_len = 0;
+        const char *extra = str->get_extra(&extra_len);
+        if (extra != nullptr) {
+            append("#. ");
+            escape_c(extra, extra_len, m_line, false);
+            append("\n");
+        }
+
+        append("msgctxt \"");
+        escape_c(name, name_len, m_line, false);
+        if (idx > 0) {
+            char suffix[16];
+            m_line.append(suffix, snprintf(suffix, sizeof(suffix), "#%d", idx));
+        }
+        append("\"\nmsgid \"");
+        escape_c(m_value.data(), m_value.size(), m_line, false);
+        append("\"\nmsgstr \"\"\n\n");
+    }
+
+
+    void export_label(csf_label *label)
+    {
+        int name_len = 0;
+        const char *name = label->name(&name_len);
+        const int n = label->size();
+
+        // 没有 string 的 label 只在 JSON 中保留，TSV 的每一行都必须有 VALUE，PO 没有对应的表示
+        if (n == 0 && m_format == FORMAT_JSON) {
+            export_json(name, name_len, nullptr);
+            flush_line();
+        }
+
+        for (int i = 0; i < n; i++) {
+            csf_string *str = label->get(i);
+            m_value.clear();
+            str->get_value(m_value);
+
+            switch (m_format) {
+                case FORMAT_TSV:    export_tsv(name, name_len, str); break;
+                case FORMAT_JSON:   export_json(name, name_len, str); break;
+                default:            export_po(name, name_len, i, str); break;
+            }
+            flush_line();
+            m_string_num ++;
+        }
+        m_label_num ++;
+    }
+
+public:
+
+    csf_exporter(file_writer& w, int format) : m_writer(w), m_format(format),
+        m_label_num(0), m_string_num(0)
+    {
+    }
+
+
+    // JSON 字符串内容的转义，不包括两端的引号
+    static void escape_json(const char *p, size_t len, buffer& out)
+    {
+        escape_c(p, len, out, true);
+    }
+
+
+    // 返回格式对应的常量，不支持时返回 -1
+    static int parse_format(const char *name)
+    {
+        if (strcmp(name, "tsv") == 0)   return FORMAT_TSV;
+        if (strcmp(name, "json") == 0)  return FORMAT_JSON;
+        if (strcmp(name, "po") == 0)    return FORMAT_PO;
+        return -1;
+    }
+
+
+    void export_file(csf_file& file)
+    {
+        if (m_format == FORMAT_PO) {
+            append("msgid \"\"\nmsgstr \"\"\n\"Content-Type: text/plain; charset=UTF-8\\n\"\n\n");
+            flush_line();
+        }
+
+        int n = 0;
+        csf_label **labels = file.children(&n);
+        std::unique_ptr<csf_label*[]> guard(labels);
+
+        for (int i = 0; i < n; i++) {
+            export_label(labels[i]);
+        }
+    }
+
+
+    int label_num() { return m_label_num; }
+
+    int string_num() { return m_string_num; }
+};
+
+};
+
+#endif
@@ -9,36 +9,163 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <memory>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "hashmap.h"
 
 namespace csf
 {
 
+class error : public std::runtime_error
+{
+public:
+    explicit error(const char *msg) : std::runtime_error(msg) { }
+};
+
+
+// 出错时抛出 csf::error，由命令行的主循环捕获并报告，不再直接退出进程
 #define abort_if(x, fmt, ...) if (x) { \
-    fprintf(stderr, fmt "%s(%d)\n", ##__VA_ARGS__, strerror(errno), errno); \
-    exit(1); \
+    char _msg[1024]; \
+    snprintf(_msg, sizeof(_msg), fmt "%s(%d)", ##__VA_ARGS__, strerror(errno), errno); \
+    throw csf::error(_msg); \
 }
 
+class mapped_file
+{
+private:
+    const uint8_t *m_data;
+    size_t m_size;
+
+public:
+    explicit mapped_file(const char *name) : m_data(nullptr), m_size(0)
+    {
+#ifdef _WIN32
+        // mingw 下没有 mmap，退化为一次性读入整个文件
+        FILE *fp = fopen(name, "rb");
+        abort_if(fp == nullptr, "can't open file %s\n", name);
+
+        // abort_if 抛出异常时由 guard 关闭文件，长时间运行的批处理不会泄漏句柄
+        struct file_guard { FILE *fp; ~file_guard() { fclose(fp); } } guard = { fp };
+
+        fseek(fp, 0, SEEK_END);
+        m_size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        if (m_size > 0) {
+            auto buff = (uint8_t*) malloc(m_size);
+            abort_if(buff == nullptr, "out of memory, file size %lu\n", (unsigned long) m_size);
+
+            size_t n = fread(buff, 1, m_size, fp);
+            if (n != m_size) free(buff);
+            abort_if(n != m_size, "expected read %lu bytes, actually %lu bytes.\n",
+                (unsigned long) m_size, (unsigned long) n);
+            m_data = buff;
+        }
+#else
+        int fd = open(name, O_RDONLY);
+        abort_if(fd < 0, "can't open file %s\n", name);
+
+        // abort_if 抛出异常时由 guard 关闭文件，长时间运行的批处理不会泄漏句柄
+        struct fd_guard { int fd; ~fd_guard() { close(fd); } } guard = { fd };
+
+        struct stat st;
+        abort_if(fstat(fd, &st) != 0, "can't stat file %s\n", name);
+        m_size = st.st_size;
+
+        // 长度为 0 的文件无法 mmap
+        if (m_size > 0) {
+            void *p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            abort_if(p == MAP_FAILED, "can't mmap file %s\n", name);
+            m_data = (const uint8_t*) p;
+        }
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    ~mapped_file()
+    {
+        if (m_data == nullptr) {
+            return;
+        }
+#ifdef _WIN32
+        free((void*) m_data);
+#else
+        munmap((void*) m_data, m_size);
+#endif
+        m_data = nullptr;
+    }
+
+
+    const uint8_t* data() { return m_data; }
+
+    size_t size() { return m_size; }
+};
+
+
+
 class file_reader
 {
 private:
-    FILE *m_fp;
+    std::shared_ptr<mapped_file> m_file;
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_offset;
 
 public:
-    explicit file_reader(const char *name) { m_fp = fopen(name, "rb"); }
+    explicit file_reader(const char *name) : m_file(new mapped_file(name)), m_offset(0)
+    {
+        m_data = m_file->data();
+        m_size = m_file->size();
+    }
+
+    // 共享同一个映射，从 offset 处开始独立读取，用于多线程解析
+    file_reader(std::shared_ptr<mapped_file> file, size_t offset) : m_file(file), m_offset(offset)
+    {
+        m_data = m_file->data();
+        m_size = m_file->size();
+    }
+
+    // 读取一段由调用者保证生命周期的内存，where() 是相对于 data 的偏移
+    file_reader(const uint8_t *data, size_t size) : m_data(data), m_size(size), m_offset(0) { }
 
 
-    ~file_reader() { fclose(m_fp); m_fp = nullptr; }
+    unsigned long where() { return m_offset; }
 
 
-    unsigned long where() { return ftell(m_fp); }
+    // 整个文件被映射到内存中，csf_file 持有它以保证视图一直有效
+    std::shared_ptr<mapped_file> source() { return m_file; }
+
+
+    // 返回指向映射区域的指针，不发生拷贝
+    const uint8_t* read_view(size_t len)
+    {
+        size_t remain = m_size - m_offset;
+        abort_if(len > remain, "expected read %lu bytes, actually %lu bytes.\n", 
+            (unsigned long) len, (unsigned long) remain);
+
+        const uint8_t *p = m_data + m_offset;
+        m_offset += len;
+        return p;
+    }
 
 
     void read_bytes(void *dst, size_t len) 
     {
-        size_t n = fread(dst, 1, len, m_fp);
-        abort_if(n != len, "expected read %lu bytes, actually %lu bytes.\n", len, n);
+        memcpy(dst, read_view(len), len);
     }
 
 
@@ -55,30 +182,256 @@ public:
 
 class file_writer
 {
+public:
+    // 保存时的 fsync 策略
+    static const int FSYNC_NONE =   0;      // 只依赖 rename 的原子性
+    static const int FSYNC_FILE =   1;      // rename 之前 fsync 临时文件
+    static const int FSYNC_DIR  =   2;      // 再 fsync 所在目录，保证 rename 本身落盘
+
+
+    static int& fsync_policy()
+    {
+        static int policy = FSYNC_FILE;
+        return policy;
+    }
+
 private:
+    static const int MAX_PATH_LEN = 4095;
+    static const size_t BUFF_SIZE = 1024 * 1024;
+
     FILE *m_fp;
+    char m_name[MAX_PATH_LEN + 1];
+    char m_temp[MAX_PATH_LEN + 1];
+
+    uint8_t *m_buff;
+    size_t m_buff_len;
+    unsigned long m_written;
+
+    // [1] 先写入同目录下的临时文件，commit 时再 rename 覆盖目标文件，
+    // 中途出错或者进程退出都不会留下写了一半的文件，
+    // 目标文件即使正被 mapped_file 映射也不受影响。
+    // "-"、管道等不是普通文件的目标无法 rename，直接写入
+
+    // [2] 所有内容先写入 m_buff，攒满后一次 fwrite，
+    // 整个文件只顺序写一遍，不需要 seek，因此也能写到管道和 stdout
+
+    // [3] abort_if 抛出异常时析构函数会删除未提交的临时文件
+
+    // [4] 目标是符号链接时写入它最终指向的文件，rename 只替换那个文件，链接本身保持不变。
+    // 链接指向的文件不存在时无法解析，不使用临时文件，直接通过链接写入
+
+
+    static bool is_regular(const char *name)
+    {
+#ifdef _WIN32
+        return true;
+#else
+        struct stat st;
+        return lstat(name, &st) != 0 || S_ISREG(st.st_mode);
+#endif
+    }
+
+
+    // 把 m_name 中的符号链接换成它指向的文件，无法解析时返回 false
+    bool resolve_link()
+    {
+#ifdef _WIN32
+        return true;
+#else
+        struct stat st;
+        if (lstat(m_name, &st) != 0 || ! S_ISLNK(st.st_mode)) {
+            return true;
+        }
+        char real[PATH_MAX + 1];
+        if (realpath(m_name, real) == nullptr || strlen(real) > MAX_PATH_LEN) {
+            return false;
+        }
+        strcpy(m_name, real);
+        return true;
+#endif
+    }
+
+
+    // 在目标文件所在目录创建临时文件
+    FILE* open_temp()
+    {
+#ifdef _WIN32
+        snprintf(m_temp, sizeof(m_temp), "%s.tmp", m_name);
+        return fopen(m_temp, "wb");
+#else
+        const char *slash = strrchr(m_name, '/');
+        int dir_len = slash ? (int) (slash - m_name + 1) : 0;
+        snprintf(m_temp, sizeof(m_temp), "%.*s.%s.XXXXXX", dir_len, m_name, m_name + dir_len);
+
+        int fd = mkstemp(m_temp);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        // mkstemp 创建的文件权限为 0600，改为与目标文件一致
+        struct stat st;
+        mode_t mode;
+        if (lstat(m_name, &st) == 0) {
+            mode = st.st_mode & 07777;
+        } else {
+            mode = umask(0);
+            umask(mode);
+            mode = 0666 & ~mode;
+        }
+        fchmod(fd, mode);
+
+        return fdopen(fd, "wb");
+#endif
+    }
+
+
+    void sync_dir()
+    {
+#ifndef _WIN32
+        const char *slash = strrchr(m_name, '/');
+        char dir[MAX_PATH_LEN + 1];
+        if (slash == nullptr) {
+            strcpy(dir, ".");
+        } else {
+            snprintf(dir, sizeof(dir), "%.*s", (int) (slash - m_name + 1), m_name);
+        }
+
+        int fd = open(dir, O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+#endif
+    }
+
+
+    void flush()
+    {
+        if (m_buff_len == 0) {
+            return;
+        }
+        size_t n = fwrite(m_buff, 1, m_buff_len, m_fp);
+        abort_if(n != m_buff_len, "expected write %lu bytes, actually %lu bytes.\n", 
+            (unsigned long) m_buff_len, (unsigned long) n);
+        m_buff_len = 0;
+    }
 
 public:
-    explicit file_writer(const char *name) { m_fp = fopen(name, "wb"); }
+    explicit file_writer(const char *name) : m_fp(nullptr), m_buff_len(0), m_written(0)
+    {
+        snprintf(m_name, sizeof(m_name), "%s", name);
+        m_temp[0] = '\0';
+
+        m_buff = (uint8_t*) malloc(BUFF_SIZE);                  // [2]
+        abort_if(m_buff == nullptr, "out of memory, buffer size %lu\n", (unsigned long) BUFF_SIZE);
+
+        if (strcmp(name, "-") == 0) {
+            m_fp = stdout;
+            fflush(stdout);
+        }
+        else if (! resolve_link() || ! is_regular(m_name)) {      // [4]
+            m_fp = fopen(m_name, "wb");
+        }
+        else {
+            m_fp = open_temp();                                 // [1]
+        }
+        if (m_fp == nullptr) {
+            free(m_buff);
+            abort_if(1, "can't open file %s\n", m_temp[0] ? m_temp : m_name);
+        }
+    }
 
-    ~file_writer() { fclose(m_fp); m_fp = nullptr; }
+    file_writer(const file_writer&) = delete;
+    file_writer& operator=(const file_writer&) = delete;
 
+    // 没有 commit 的内容全部丢弃，目标文件保持原样 [3]
+    ~file_writer()
+    {
+        free(m_buff);
+        m_buff = nullptr;
 
-    void jump(long offset, int from) { fseek(m_fp, offset, from); }
+        if (m_fp != nullptr && m_fp != stdout) {
+            fclose(m_fp);
+        }
+        m_fp = nullptr;
 
+        if (m_temp[0] != '\0') {
+            remove(m_temp);
+        }
+    }
 
-    unsigned long where() { return ftell(m_fp); }
 
+    // 写入剩余内容，按 fsync 策略落盘后 rename 到目标文件
+    void commit()
+    {
+        flush();
+
+        if (m_fp == stdout) {
+            fflush(stdout);
+            m_fp = nullptr;
+            return;
+        }
+
+        const int policy = fsync_policy();
+
+        abort_if(fflush(m_fp) != 0, "can't write file %s\n", m_name);
+        if (policy >= FSYNC_FILE && m_temp[0] != '\0') {
+#ifdef _WIN32
+            _commit(_fileno(m_fp));
+#else
+            abort_if(fsync(fileno(m_fp)) != 0, "can't fsync file %s\n", m_temp);
+#endif
+        }
+
+        int ret = fclose(m_fp);
+        m_fp = nullptr;
+        abort_if(ret != 0, "can't close file %s\n", m_temp[0] ? m_temp : m_name);
+
+        if (m_temp[0] == '\0') {
+            return;
+        }
+
+#ifdef _WIN32
+        ret = MoveFileExA(m_temp, m_name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+#else
+        ret = rename(m_temp, m_name);
+#endif
+        abort_if(ret != 0, "can't rename %s to %s\n", m_temp, m_name);
+
+        m_temp[0] = '\0';
+
+        if (policy >= FSYNC_DIR) {
+            sync_dir();
+        }
+    }
 
-    void write_bytes(void *dst, size_t len)
+
+    unsigned long where() { return m_written; }
+
+
+    void write_bytes(const void *dst, size_t len)
     {
+        m_written += len;
+
+        if (m_buff_len + len <= BUFF_SIZE) {
+            memcpy(m_buff + m_buff_len, dst, len);
+            m_buff_len += len;
+            return;
+        }
+
+        flush();
+        if (len < BUFF_SIZE) {
+            memcpy(m_buff, dst, len);
+            m_buff_len = len;
+            return;
+        }
+
+        // 大块内容不经过缓冲区
         size_t n = fwrite(dst, 1, len, m_fp);
-        abort_if(n != len, "expected write %lu bytes, actually %lu bytes.\n", len, n);
+        abort_if(n != len, "expected write %lu bytes, actually %lu bytes.\n", 
+            (unsigned long) len, (unsigned long) n);
     }
 
-    // template <typename T>
-    // void write_bytes(T *dst) { write_bytes(dst, sizeof(T)); }
-
 
     template <typename T>
     void write_bytes(T t) { write_bytes(&t, sizeof(T)); }
@@ -1,11 +1,90 @@
 
 
-
 #include <stdlib.h>
 #include <string.h>
 #include "hashmap.h"
 
 
+/*
+ * 开放寻址 + Robin Hood 线性探测。
+ * slots 中每个槽只有 8 个字节 (hash 指纹和下标)，查找通常只访问一到两条 cache line；
+ * key/value 按插入顺序存放在 entries 数组中，删除时只做标记，积累到一定数量后统一压缩
+ */
+
+
+static int hashmap_hash(const void *key, int (*hash)(const void*))
+{
+    int h = hash(key);
+    return h ^ (h >> 16);
+}
+
+
+static int hashmap_threshold(hashmap *map)
+{
+    return (int) (map->ops.capacity * map->ops.load_factor);
+}
+
+
+/* 槽中的元素距离其理想位置的距离 */
+static unsigned int hashmap_distance(hashmap *map, unsigned int pos, unsigned int hash)
+{
+    unsigned int mask = map->ops.capacity - 1;
+    return (pos - (hash & mask)) & mask;
+}
+
+
+static void hashmap_place(hashmap *map, hashmap_slot cur)
+{
+    unsigned int mask = map->ops.capacity - 1;
+    unsigned int pos = cur.hash & mask;
+    unsigned int dist = 0;
+
+    for (;; pos = (pos + 1) & mask, dist ++) {
+        hashmap_slot *s = map->slots + pos;
+        if (s->index < 0) {
+            *s = cur;
+            return;
+        }
+        // 劫富济贫：离理想位置更近的元素让出位置
+        unsigned int d = hashmap_distance(map, pos, s->hash);
+        if (d < dist) {
+            hashmap_slot t = *s;
+            *s = cur;
+            cur = t;
+            dist = d;
+        }
+    }
+}
+
+
+/* 压缩 entries 并重建 slots，capacity 必须是 2 的幂 */
+static int hashmap_rebuild(hashmap *map, int capacity)
+{
+    hashmap_slot *slots = (hashmap_slot*) malloc(sizeof(hashmap_slot) * capacity);
+    if (slots == NULL) {
+        return -1;
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->ops.capacity = capacity;
+    memset(slots, 0xFF, sizeof(hashmap_slot) * capacity);
+
+    int j = 0;
+    for (int i = 0; i < map->entries_len; i++) {
+        if (map->entries[i].deleted) {
+            continue;
+        }
+        map->entries[j] = map->entries[i];
+
+        hashmap_slot s = { (unsigned int) map->entries[j].hash, j };
+        hashmap_place(map, s);
+        j ++;
+    }
+    map->entries_len = j;
+    return 0;
+}
+
+
 int hashmap_setup(hashmap *map, hashmap_options *ops)
 {
     memset(map, 0, sizeof(hashmap));
@@ -14,15 +93,15 @@ int hashmap_setup(hashmap *map, hashmap_options *ops)
 
     // 调整初始容量
     int n = ops->capacity - 1;
-    n |= n >> 1; 
-    n |= n >> 2; 
-    n |= n >> 4; 
-    n |= n >> 8; 
+    n |= n >> 1;
+    n |= n >> 2;
+    n |= n >> 4;
+    n |= n >> 8;
     n |= n >> 16;
-    map->ops.capacity = n == -1 ? 16 : n + 1;
+    map->ops.capacity = n <= 0 ? 16 : n + 1;
 
-    // 调整扩容阈值
-    if (map->ops.load_factor == 0) {
+    // 调整扩容阈值，开放寻址的装载因子不能太接近 1
+    if (map->ops.load_factor <= 0 || map->ops.load_factor > 0.9f) {
         map->ops.load_factor = 0.75f;
     }
 
@@ -35,75 +114,134 @@ int hashmap_setup(hashmap *map, hashmap_options *ops)
     }
 
     // 申请空间
-    size_t buff_len = sizeof(hashmap_entry*) * map->ops.capacity;
-    map->tables = (hashmap_entry**) malloc(buff_len);
-    if (map->tables == NULL) {
+    size_t buff_len = sizeof(hashmap_slot) * map->ops.capacity;
+    map->slots = (hashmap_slot*) malloc(buff_len);
+    if (map->slots == NULL) {
+        return -1;
+    }
+    memset(map->slots, 0xFF, buff_len);
+
+    map->entries_capacity = hashmap_threshold(map) + 1;
+    map->entries = (hashmap_entry*) malloc(sizeof(hashmap_entry) * map->entries_capacity);
+    if (map->entries == NULL) {
+        free(map->slots);
+        map->slots = NULL;
         return -1;
     }
-    memset(map->tables, 0, buff_len);
 
     return 0;
 }
 
 
-static int hashmap_hash(const void *key, int (*hash)(const void*))
+/* 返回 key 所在的槽，不存在时返回 -1 */
+static int hashmap_find_slot(hashmap *map, const void *key, int hash)
 {
-    int h = hash(key);
-    return h ^ (h >> 16);
+    unsigned int mask = map->ops.capacity - 1;
+    unsigned int pos = (unsigned int) hash & mask;
+
+    for (unsigned int dist = 0;; pos = (pos + 1) & mask, dist ++) {
+        hashmap_slot *s = map->slots + pos;
+        if (s->index < 0 || hashmap_distance(map, pos, s->hash) < dist) {
+            // 遇到空槽，或者遇到比 key 更靠近理想位置的元素，key 一定不存在
+            return -1;
+        }
+        if (s->hash == (unsigned int) hash) {
+            hashmap_entry *e = map->entries + s->index;
+            if (key == e->key || map->ops.cmp(key, e->key) == 0) {
+                return (int) pos;
+            }
+        }
+    }
 }
 
-static void hashmap_set_head(hashmap *map, hashmap_entry *e)
+
+/* 预先扩容到可以放下 n 个元素，批量插入时避免多次重建 */
+int hashmap_reserve(hashmap *map, int n)
 {
-    if (map->head == e) {
-        return;
+    if (n > map->entries_capacity) {
+        hashmap_entry *entries = (hashmap_entry*) realloc(map->entries, sizeof(hashmap_entry) * n);
+        if (entries == NULL) {
+            return -1;
+        }
+        map->entries = entries;
+        map->entries_capacity = n;
     }
-    
 
-    if (e->after != NULL) {
-        e->after->before = e->before;
-    } else {
-        map->tail = e->before;
+    int capacity = map->ops.capacity;
+    while ((int) (capacity * map->ops.load_factor) < n) {
+        capacity <<= 1;
     }
+    return capacity == map->ops.capacity ? 0 : hashmap_rebuild(map, capacity);
+}
+
 
-    e->before->after = e->after;
-    e->before = NULL;
-    e->after = map->head;
-    map->head->before = e;
-    map->head = e;
+/* 保证 entries 末尾还有空位，可能会压缩 entries 导致下标变化 */
+static int hashmap_reserve_entry(hashmap *map)
+{
+    if (map->entries_len < map->entries_capacity) {
+        return 0;
+    }
+
+    // 被删除的元素较多时只压缩，否则扩大 entries
+    if (map->entries_len - map->size > map->size / 2) {
+        return hashmap_rebuild(map, map->ops.capacity);
+    }
+
+    int capacity = map->entries_capacity * 2;
+    hashmap_entry *entries = (hashmap_entry*) realloc(map->entries, sizeof(hashmap_entry) * capacity);
+    if (entries == NULL) {
+        return -1;
+    }
+    map->entries = entries;
+    map->entries_capacity = capacity;
+    return 0;
 }
 
-static hashmap_entry* hashmap_find_entry(hashmap *map, const void *key, int hash, hashmap_entry **pPrev)
+
+/* 如果 access_order 设为 true，把元素挪到 entries 末尾 (即最近访问) */
+static hashmap_entry* hashmap_touch(hashmap *map, const void *key, int hash, int pos)
 {
-    hashmap_entry *e, *prev = NULL;
-
-    int index = hash & (map->ops.capacity - 1);
-    for (e = map->tables[index]; e; e = e->next) {
-        if (hash == e->hash && (key == e->key || map->ops.cmp(key, e->key) == 0)) {
-            // 如果 access_order 设为 true，
-            // 需要把这个节点设置为双向链表的头节点
-            if (map->ops.access_order) {
-                hashmap_set_head(map, e);
-            }
-            break;
-        }
-        prev = e;
+    if (! map->ops.access_order || map->slots[pos].index == map->entries_len - 1) {
+        return map->entries + map->slots[pos].index;
+    }
+
+    if (hashmap_reserve_entry(map) != 0) {
+        return map->entries + map->slots[pos].index;
+    }
+    // 可能发生了压缩，重新定位
+    pos = hashmap_find_slot(map, key, hash);
+
+    hashmap_entry *e = map->entries + map->slots[pos].index;
+    if (map->slots[pos].index == map->entries_len - 1) {
+        return e;
     }
-    if (pPrev) *pPrev = prev;
-    return e;
+
+    int index = map->entries_len ++;
+    map->entries[index] = *e;
+    e->deleted = 1;
+    map->slots[pos].index = index;
+    return map->entries + index;
+}
+
+
+static hashmap_entry* hashmap_find_entry(hashmap *map, const void *key, int hash)
+{
+    int pos = hashmap_find_slot(map, key, hash);
+    return pos < 0 ? NULL : hashmap_touch(map, key, hash, pos);
 }
 
 
 hashmap_entry* hashmap_contains(hashmap *map, const void *key)
 {
     int hash = hashmap_hash(key, map->ops.hash);
-    return hashmap_find_entry(map, key, hash, NULL);
+    return hashmap_find_entry(map, key, hash);
 }
 
 
 const void* hashmap_get(hashmap *map, const void *key)
 {
     int hash = hashmap_hash(key, map->ops.hash);
-    hashmap_entry *e = hashmap_find_entry(map, key, hash, NULL);
+    hashmap_entry *e = hashmap_find_entry(map, key, hash);
     return e ? e->value : NULL;
 }
 
@@ -112,131 +250,42 @@ const void* hashmap_remove(hashmap *map, const void *key, const void **old_key)
 {
     if (old_key) *old_key = NULL;
 
-
     int hash = hashmap_hash(key, map->ops.hash);
-    int index = hash & (map->ops.capacity - 1);
-
-    hashmap_entry *prev = NULL;
-    hashmap_entry *e = hashmap_find_entry(map, key, hash, &prev);
+    int pos = hashmap_find_slot(map, key, hash);
 
-    if (e == NULL) {
+    if (pos < 0) {
         return NULL;
     }
 
-    // 先从 table 中移除这个 entry
-    if (prev == NULL) {
-        map->tables[index] = e->next;
-    } else {
-        prev->next = e->next;
-    }
+    hashmap_entry *e = map->entries + map->slots[pos].index;
+    e->deleted = 1;
 
-    // 还需要调整双向链表
-    if (map->head == map->tail) {
-        // 双向链表中只有一个元素，直接置为 null
-        map->head = map->tail = NULL;
-    }
-    else if (e == map->head) {
-        // 位于双向链表的头部，调整头指针
-        map->head = e->after;
-        e->after->before = NULL;
-    }
-    else if (e == map->tail) {
-        // 位于双向链表尾部，调整尾指针
-        map->tail = e->before;
-        e->before->after = NULL;
-    }
-    else {
-        // 位于双向链表中间
-        e->before->after = e->after;
-        e->after->before = e->before;
+    // 向后移位删除，后续元素依次前移，不需要墓碑
+    unsigned int mask = map->ops.capacity - 1;
+    unsigned int cur = pos, next = (pos + 1) & mask;
+    while (map->slots[next].index >= 0 && hashmap_distance(map, next, map->slots[next].hash) > 0) {
+        map->slots[cur] = map->slots[next];
+        cur = next;
+        next = (next + 1) & mask;
     }
+    map->slots[cur].index = -1;
 
     map->size --;
+    if (map->size == 0) {
+        map->entries_len = 0;
+    }
 
     if (old_key) *old_key = e->key;
-    const void *old = e->value;
-    free(e);
-    return old;
+    return e->value;
 }
 
 
-
-static hashmap_entry* hashmap_new_entry(const void *key, const void *value, int hash)
-{
-    hashmap_entry* e = (hashmap_entry*) malloc(sizeof(hashmap_entry));
-    if (e) {
-        e->key = key;
-        e->value = value;
-        e->hash = hash;
-        e->next = NULL;
-        e->before = e->after = NULL;
-    }
-    return e;
-}
-
-static void hashmap_resize(hashmap *map)
-{
-    if (map->size <= (int) (map->ops.capacity * map->ops.load_factor)) {
-        return;
-    }
-
-    // cat_hashmap(map);
-
-    int old_capacity = map->ops.capacity;
-    int new_capacity = old_capacity << 1;
-    hashmap_entry **new_tables = (hashmap_entry**) realloc(
-                    map->tables, sizeof(hashmap_entry*) * new_capacity);
-
-    if (new_tables == NULL) {
-        return;
-    }
-
-    map->ops.capacity = new_capacity;
-    map->tables = new_tables;
-
-    for (int i = 0; i < old_capacity; i++) {
-
-        hashmap_entry *lo_head = NULL, *lo_tail = NULL;
-        hashmap_entry *hi_head = NULL, *hi_tail = NULL;
-
-        for (hashmap_entry *e = new_tables[i]; e; e = e->next) {
-            int index = e->hash & (new_capacity - 1);
-            if (index == i) {
-                if (lo_head == NULL) {
-                    lo_head = lo_tail = e;
-                } else {
-                    lo_tail->next = e;
-                    lo_tail = e;
-                }
-            } 
-            else {
-                if (hi_head == NULL) {
-                    hi_head = hi_tail = e;
-                } else {
-                    hi_tail->next = e;
-                    hi_tail = e;
-                }
-            }
-        }
-        if (hi_tail) hi_tail->next = NULL;
-        if (lo_tail) lo_tail->next = NULL;
-
-        new_tables[i] = lo_head;
-        new_tables[old_capacity + i] = hi_head;
-    }
-
-    // cat_hashmap(map);
-}
-
 const void* hashmap_put(hashmap *map, const void *key, const void *value, const void **old_key)
 {
     if (old_key) *old_key = NULL;
 
     int hash = hashmap_hash(key, map->ops.hash);
-    int index = hash & (map->ops.capacity - 1);
-
-    hashmap_entry *prev = NULL;
-    hashmap_entry *e = hashmap_find_entry(map, key, hash, &prev);
+    hashmap_entry *e = hashmap_find_entry(map, key, hash);
 
     if (e != NULL) {
         if (old_key) *old_key = e->key;
@@ -246,43 +295,104 @@ const void* hashmap_put(hashmap *map, const void *key, const void *value, const
         return old;
     }
 
-    e = hashmap_new_entry(key, value, hash);
-    if (e == NULL) {
+    // 可能需要扩容
+    if (map->size + 1 > hashmap_threshold(map)) {
+        if (hashmap_rebuild(map, map->ops.capacity << 1) != 0) {
+            return NULL;
+        }
+    }
+    if (hashmap_reserve_entry(map) != 0) {
         return NULL;
     }
-    // 放到 table 中
-    if (prev == NULL) {
-        map->tables[index] = e;
+
+    int index = map->entries_len ++;
+    e = map->entries + index;
+    e->key = key;
+    e->value = value;
+    e->hash = hash;
+    e->deleted = 0;
+
+    hashmap_slot s = { (unsigned int) hash, index };
+    hashmap_place(map, s);
+
+    map->size ++;
+    return NULL;
+}
+
+
+
+int hashmap_restore(hashmap *map, const hashmap_slot *slots, int capacity, int n)
+{
+    if (capacity <= 0 || (capacity & (capacity - 1)) != 0 || n < 0 || n > capacity) {
+        return -1;
     }
-    else {
-        e->next = prev->next;
-        prev->next = e;
+
+    // 每个元素恰好占一个槽，否则删除和查找都会出错
+    unsigned char *seen = (unsigned char*) calloc(n + 1, 1);
+    if (seen == NULL) {
+        return -1;
+    }
+    int used = 0;
+    for (int i = 0; i < capacity; i++) {
+        int index = slots[i].index;
+        if (index < 0) {
+            continue;
+        }
+        if (index >= n || seen[index]) {
+            free(seen);
+            return -1;
+        }
+        seen[index] = 1;
+        used ++;
+    }
+    free(seen);
+    if (used != n) {
+        return -1;
     }
 
-    // 调整双向链表
-    if (map->head == NULL) {
-        map->head = map->tail = e;
+    hashmap_slot *s = (hashmap_slot*) malloc(sizeof(hashmap_slot) * capacity);
+    if (s == NULL) {
+        return -1;
     }
-    else {
-        map->tail->after = e;
-        e->before = map->tail;
-        map->tail = e;
+    int entries_capacity = n > map->entries_capacity ? n : map->entries_capacity;
+    hashmap_entry *entries = (hashmap_entry*) realloc(map->entries, sizeof(hashmap_entry) * entries_capacity);
+    if (entries == NULL) {
+        free(s);
+        return -1;
     }
+    map->entries = entries;
+    map->entries_capacity = entries_capacity;
 
-    if (map->ops.access_order) {
-        // 如果 access_order 设置为 true,
-        // 将按照访问顺序排序，因此要设置为头节点
-        hashmap_set_head(map, e);
+    memcpy(s, slots, sizeof(hashmap_slot) * capacity);
+    free(map->slots);
+    map->slots = s;
+    map->ops.capacity = capacity;
+
+    memset(map->entries, 0, sizeof(hashmap_entry) * n);
+    for (int i = 0; i < capacity; i++) {
+        if (s[i].index >= 0) {
+            map->entries[s[i].index].hash = (int) s[i].hash;
+        }
     }
+    map->entries_len = n;
+    map->size = n;
 
-    // 可能需要扩容
-    map->size ++;
-    hashmap_resize(map);
-    return NULL;
+    // 装载因子可能与保存时不同，超过阈值时扩容
+    if (map->size > hashmap_threshold(map)) {
+        return hashmap_rebuild(map, capacity << 1);
+    }
+    return 0;
 }
 
 
 
+/* 按顺序返回第 i 个元素 (可能已删除)，插入顺序时从旧到新；access_order 时从最近访问的开始 */
+static hashmap_entry* hashmap_at(hashmap *map, int i)
+{
+    return map->entries + (map->ops.access_order ? map->entries_len - 1 - i : i);
+}
+
+
 hashmap_entry** hashmap_entries(hashmap *map, int *pSize)
 {
     int n = map->size, j = 0;
@@ -292,8 +402,9 @@ hashmap_entry** hashmap_entries(hashmap *map, int *pSize)
         goto bail;
     }
 
-    for (hashmap_entry *e = map->head; e; e = e->after) {
-        tables[j++] = e;
+    for (int i = 0; i < map->entries_len; i++) {
+        hashmap_entry *e = hashmap_at(map, i);
+        if (! e->deleted) tables[j++] = e;
     }
 
 bail:
@@ -311,8 +422,9 @@ void** hashmap_keys(hashmap *map, int *pSize)
         goto bail;
     }
 
-    for (hashmap_entry *e = map->head; e; e = e->after) {
-        tables[j++] = (void*) e->key;
+    for (int i = 0; i < map->entries_len; i++) {
+        hashmap_entry *e = hashmap_at(map, i);
+        if (! e->deleted) tables[j++] = (void*) e->key;
     }
 
 bail:
@@ -326,13 +438,15 @@ bail:
 void** hashmap_values(hashmap *map, int *pSize)
 {
     int n = map->size, j = 0;
+
     void **tables = (void**) malloc(n * sizeof(void*));
     if (tables == NULL) {
         goto bail;
     }
 
-    for (hashmap_entry *e = map->head; e; e = e->after) {
-        tables[j++] = (void*) e->value;
+    for (int i = 0; i < map->entries_len; i++) {
+        hashmap_entry *e = hashmap_at(map, i);
+        if (! e->deleted) tables[j++] = (void*) e->value;
     }
 bail:
     if (tables == NULL) n = 0;
@@ -340,62 +454,41 @@ bail:
     return tables;
 }
 
-void hashmap_clear(hashmap *map)
-{
-    for (hashmap_entry *e = map->head; e; ) {
-        hashmap_entry *next = e->after;
-        free(e);
-        e = next;
-    }
-    map->size = 0;
-    map->head = map->tail = NULL;
-    memset(map->tables, 0, sizeof(void*) * map->ops.capacity);
-}
 
-void hashmap_destroy(hashmap *map)
+void hashmap_stats(hashmap *map, hashmap_stat *stat)
 {
-    hashmap_clear(map);
-    free(map->tables);
-    map->tables = NULL;
-}
-
+    memset(stat, 0, sizeof(hashmap_stat));
+    stat->capacity = map->ops.capacity;
+    stat->size = map->size;
 
-#if 0
-void cat_hashmap(hashmap *map)
-{
-    const char* fmt = 
-        "hashmap[%p] = {\n"
-        "\t.ops = {\n"
-        "\t\t.capacity = %d,\n"
-        "\t\t.load_factor = %f,\n"
-        "\t\t.access_order = %d,\n"
-        "\t\t.hash = %p,\n"
-        "\t\t.cmp = %p,\n"
-        "\t},\n"
-        "\t.size = %d,\n"
-        "\t.tables = {\n";
-    printf(fmt, map, map->ops.capacity, map->ops.load_factor, map->ops.access_order, 
-        map->ops.hash, map->ops.cmp, map->size);
+    long probes = 0;
     for (int i = 0; i < map->ops.capacity; i++) {
-        printf("\t\t[%d]: ", i);
-        for (hashmap_entry *e = map->tables[i]; e; e = e->next) {
-            printf("[%d][%d]->", *((int*) (e->key)), *((int*) (e->value)));
+        hashmap_slot *s = map->slots + i;
+        if (s->index < 0) {
+            continue;
         }
-        printf("NULL\n");
+        int d = (int) hashmap_distance(map, i, s->hash);
+        probes += d + 1;
+        stat->used ++;
+        if (d + 1 > stat->max_probe) stat->max_probe = d + 1;
+        stat->histogram[d < 7 ? d : 7] ++;
     }
-    printf("\t},\n"
-        "\t.head = ");
+    stat->avg_probe = map->size ? (double) probes / map->size : 0;
+}
 
-    for (hashmap_entry *e = map->head; e; e = e->after) {
-        printf("[%d][%d]->", *((int*) (e->key)), *((int*) (e->value)));
-    }
-    printf("NULL,\n"
-        "\t.tail = ");
-    for (hashmap_entry *e = map->tail; e; e = e->before) {
-        printf("[%d][%d]->", *((int*) (e->key)), *((int*) (e->value)));
-    }
-    printf("NULL,\n"
-        "}\n");
+void hashmap_clear(hashmap *map)
+{
+    map->size = 0;
+    map->entries_len = 0;
+    memset(map->slots, 0xFF, sizeof(hashmap_slot) * map->ops.capacity);
 }
 
-#endif
\ No newline at end of file
+void hashmap_destroy(hashmap *map)
+{
+    free(map->slots);
+    free(map->entries);
+    map->slots = NULL;
+    map->entries = NULL;
+    map->size = 0;
+    map->entries_len = map->entries_capacity = 0;
+}
@@ -42,27 +42,51 @@ struct hashmap_entry;
 typedef struct hashmap_entry hashmap_entry;
 
 
+/* entries 数组中的元素，按插入 (或访问) 顺序排列 */
 struct hashmap_entry
 {
     const void *key;
     const void *value;
     int hash;
-    hashmap_entry *next;
-    hashmap_entry *before, *after;
+    int deleted;                            /* 已删除，等待压缩 */
 };
 
 
+/* 开放寻址表中的槽，只存放 hash 指纹和 entries 下标 */
+typedef struct
+{
+    unsigned int hash;
+    int index;                              /* -1 表示空槽 */
+
+} hashmap_slot;
+
+
 typedef struct
 {
     hashmap_options ops;
-    hashmap_entry **tables;
+    hashmap_slot *slots;                    /* ops.capacity 个槽，Robin Hood 线性探测 */
+    hashmap_entry *entries;
+    int entries_len;                        /* 包括已删除的元素 */
+    int entries_capacity;
     int size;
-    hashmap_entry *head, *tail;
 
 } hashmap;
 
 
 
+typedef struct
+{
+    int capacity;
+    int size;
+    int used;                               /* 非空的槽数 */
+    int max_probe;                          /* 最长的探测距离 */
+    double avg_probe;                       /* 查找已存在的 key 平均需要探测的槽数 */
+    int histogram[8];                       /* 探测距离为 0 ~ 6 以及 >= 7 的元素数 */
+
+} hashmap_stat;
+
+
+
 int hashmap_setup(hashmap *map, hashmap_options *ops);
 
 
@@ -70,6 +94,9 @@ int hashmap_setup(hashmap *map, hashmap_options *ops);
 void hashmap_clear(hashmap *map);
 
 
+int hashmap_reserve(hashmap *map, int n);
+
+
 hashmap_entry* hashmap_contains(hashmap *map, const void *key);
 
 
@@ -91,6 +118,17 @@ void** hashmap_values(hashmap *map, int *pSize);
 void** hashmap_keys(hashmap* map, int *pSize);
 
 
+/*
+ * 用保存下来的 slots (同样的 ops 下 map->slots 的拷贝) 直接恢复 n 个元素，不重新计算 hash，也不逐个插入。
+ * 成功后由调用者按原来的插入顺序填写 entries[0, n) 的 key 和 value，填写完之前不能访问 map。
+ * slots 不完整 (某个元素没有槽或者占了多个槽) 时返回 -1，map 保持原样
+ */
+int hashmap_restore(hashmap *map, const hashmap_slot *slots, int capacity, int n);
+
+
+void hashmap_stats(hashmap *map, hashmap_stat *stat);
+
+
 void hashmap_destroy(hashmap *map);
 
 
@@ -0,0 +1,397 @@
+
+
+#ifndef _CSF_IMPORT_HPP
+#define _CSF_IMPORT_HPP
+
+
+#include "csf.hpp"
+#include "buffer.hpp"
+
+
+namespace csf
+{
+
+// 从文本文件批量导入 label，整个文件被映射到内存中逐行解析，
+// 字符串直接写入 csf_file 中新建的 label，不经过临时的 csf_label/csf_string。
+//
+// TSV:         LABEL<TAB>VALUE[<TAB>EXTRA]，支持 \t \n \r \\ 转义
+// JSON lines:  {"label": "...", "value": "...", "extra": "..."}
+//
+// 连续多行的 LABEL 相同时，追加为同一个 label 的多个 string。
+// TSV 的每一行都必须有 VALUE 列；JSON 中只有 label 没有 value 的行创建一个空的 label。
+// LABEL 为空的行和无法编码的内容都报告为 文件:行号 的错误。
+// JSON 中 "op": "remove" 的行删除该 label，diff 生成的补丁因此可以直接导入；
+// "op": "step" 的行只分隔编辑日志中的 step，之后的同名行不再追加到前一个 label
+class csf_importer
+{
+public:
+    static const int FORMAT_AUTO    =   -1;
+    static const int FORMAT_TSV     =   0;
+    static const int FORMAT_JSON    =   1;
+
+private:
+    csf_file& m_file;
+
+    const char *m_source;
+    int m_line;
+
+    buffer m_name, m_value, m_extra, m_key;
+    bool m_has_value, m_has_extra, m_remove, m_step;
+
+    csf_label *m_label;     // 上一行创建的 label，用于合并连续的同名行
+    int m_label_num;
+    int m_string_num;
+    int m_remove_num;
+
+
+    // 按扩展名判断，无法判断时看第一个非空白字符
+    static int guess_format(const char *file_name, const uint8_t *data, size_t len)
+    {
+        const char *dot = strrchr(file_name, '.');
+        if (dot != nullptr) {
+            if (strcmp(dot, ".tsv") == 0 || strcmp(dot, ".txt") == 0) return FORMAT_TSV;
+            if (strcmp(dot, ".json") == 0 || strcmp(dot, ".jsonl") == 0 ||
+                strcmp(dot, ".ndjson") == 0) return FORMAT_JSON;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (data[i] > ' ') return data[i] == '{' ? FORMAT_JSON : FORMAT_TSV;
+        }
+        return FORMAT_TSV;
+    }
+
+
+    void add_line()
+    {
+        const char *name = m_name.data();
+        const size_t name_len = m_name.size();
+
+        if (m_step) {
+            m_label = nullptr;
+            return;
+        }
+
+        abort_if(name_len == 0, "%s:%d: empty label name\n", m_source, m_line);
+
+        if (m_remove) {
+            m_file.remove(name, name_len);
+            m_label = nullptr;
+            m_remove_num ++;
+            return;
+        }
+
+        // 先在临时对象上编码，失败时不会留下新建的 label 或者空的 string
+        csf_string str;
+        if (m_has_value) {
+            try {
+                str.set_value(m_value.data(), m_value.size(), m_file.get_pool());
+                if (m_has_extra) {
+                    str.set_extra(m_extra.data(), m_extra.size(), m_file.get_pool());
+                }
+            }
+            catch (const csf::error& e) {
+                // 编码的错误不知道来源，补上文件名和行号
+                char msg[1024];
+                snprintf(msg, sizeof(msg), "%s:%d: %s", m_source, m_line, e.what());
+                throw csf::error(msg);
+            }
+        }
+
+        int len = 0;
+        const char *last = m_label ? m_label->name(&len) : nullptr;
+
+        if (last == nullptr || (size_t) len != name_len || memcmp(last, name, name_len) != 0) {
+            m_label = m_file.emplace(name, name_len);
+            m_label_num ++;
+        }
+
+        if (m_has_value) {
+            *m_label->emplace(m_label->size()) = str;
+            m_string_num ++;
+        }
+    }
+
+
+    // ---------- TSV ----------
+
+    static int hex_digit(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static int hex2(const char *p)
+    {
+        int hi = hex_digit(p[0]), lo = hex_digit(p[1]);
+        return hi < 0 || lo < 0 ? -1 : (hi << 4) | lo;
+    }
+
+    static void unescape_tsv(const char *p, const char *end, buffer& out)
+    {
+        out.clear();
+        char *dst = out.reserve(end - p);
+        char *begin = dst;
+
+        while (p < end) {
+            char c = *p++;
+            if (c == '\\' && p < end) {
+                switch (*p) {
+                    case 't':   c = '\t'; p++; break;
+                    case 'n':   c = '\n'; p++; break;
+                    case 'r':   c = '\r'; p++; break;
+                    case '\\':  c = '\\'; p++; break;
+                    case 'x': {
+                        // export 把不合法的 UTF-8 字节写成 \xHH
+                        int h = end - p >= 3 ? hex2(p + 1) : -1;
+                        if (h >= 0) {
+                            c = (char) h;
+                            p += 3;
+                        }
+                        break;
+                    }
+                    default:    break;
+                }
+            }
+            *dst++ = c;
+        }
+        out.commit(dst - begin);
+    }
+
+    void parse_tsv(const char *p, const char *end)
+    {
+        const char *tab1 = (const char*) memchr(p, '\t', end - p);
+        const char *tab2 = tab1 ? (const char*) memchr(tab1 + 1, '\t', end - tab1 - 1) : nullptr;
+
+        abort_if(tab1 == nullptr, "%s:%d: missing value, expected LABEL<TAB>VALUE[<TAB>EXTRA]\n",
+            m_source, m_line);
+        unescape_tsv(p, tab1, m_name);
+
+        m_has_value = true;
+        unescape_tsv(tab1 + 1, tab2 ? tab2 : end, m_value);
+
+        m_has_extra = tab2 != nullptr;
+        if (m_has_extra) {
+            unescape_tsv(tab2 + 1, end, m_extra);
+        }
+    }
+
+
+    // ---------- JSON ----------
+
+    static void skip_space(const char *&p, const char *end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    }
+
+    static int hex4(const char *p)
+    {
+        int v = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = p[i];
+            v <<= 4;
+            if (c >= '0' && c <= '9')       v |= c - '0';
+            else if (c >= 'a' && c <= 'f')  v |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')  v |= c - 'A' + 10;
+            else return -1;
+        }
+        return v;
+    }
+
+    static void put_utf8(buffer& out, uint32_t c)
+    {
+        char *dst = out.reserve(4);
+        int n;
+        if (c < 0x80)           { dst[0] = (char) c; n = 1; }
+        else if (c < 0x800)     { dst[0] = (char) (0xC0 | (c >> 6)); n = 2; }
+        else if (c < 0x10000)   { dst[0] = (char) (0xE0 | (c >> 12)); n = 3; }
+        else                    { dst[0] = (char) (0xF0 | (c >> 18)); n = 4; }
+        for (int i = n - 1; i > 0; i--, c >>= 6) {
+            dst[i] = (char) (0x80 | (c & 0x3F));
+        }
+        out.commit(n);
+    }
+
+    // p 指向开头的引号，解析后指向结尾引号之后
+    void parse_json_string(const char *&p, const char *end, buffer& out)
+    {
+        out.clear();
+        p ++;
+
+        while (true) {
+            // 没有转义的部分整段拷贝
+            const char *q = p;
+            while (q < end && *q != '"' && *q != '\\') q++;
+            out.append(p, q - p);
+            p = q;
+
+            abort_if(p >= end, "%s:%d: unterminated json string\n", m_source, m_line);
+            if (*p++ == '"') {
+                return;
+            }
+
+            abort_if(p >= end, "%s:%d: unterminated json string\n", m_source, m_line);
+            char c = *p++;
+            switch (c) {
+                case '"':   case '\\':  case '/':   out.append(&c, 1); break;
+                case 'b':   out.append("\b", 1); break;
+                case 'f':   out.append("\f", 1); break;
+                case 'n':   out.append("\n", 1); break;
+                case 'r':   out.append("\r", 1); break;
+                case 't':   out.append("\t", 1); break;
+                case 'u': {
+                    int u = end - p >= 4 ? hex4(p) : -1;
+                    abort_if(u < 0, "%s:%d: invalid \\u escape\n", m_source, m_line);
+                    p += 4;
+
+                    // 代理项对合并为一个码点，孤立的代理项原样保留
+                    if (u >= 0xD800 && u < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+                        int v = hex4(p + 2);
+                        if (v >= 0xDC00 && v < 0xE000) {
+                            u = 0x10000 + ((u - 0xD800) << 10) + (v - 0xDC00);
+                            p += 6;
+                        }
+                    }
+                    put_utf8(out, u);
+                    break;
+                }
+                default:
+                    abort_if(1, "%s:%d: invalid escape \\%c\n", m_source, m_line, c);
+            }
+        }
+    }
+
+    // 跳过不关心的值，只支持字符串、数字、true/false/null
+    void skip_json_value(const char *&p, const char *end, buffer& scratch)
+    {
+        if (p < end && *p == '"') {
+            parse_json_string(p, end, scratch);
+            return;
+        }
+        while (p < end && *p != ',' && *p != '}') p++;
+    }
+
+    void parse_json(const char *p, const char *end)
+    {
+        m_name.clear();
+        m_has_value = m_has_extra = m_remove = m_step = false;
+        bool has_name = false;
+
+        skip_space(p, end);
+        abort_if(p >= end || *p != '{', "%s:%d: expected '{'\n", m_source, m_line);
+        p ++;
+
+        buffer& key = m_key;
+        while (true) {
+            skip_space(p, end);
+            if (p < end && *p == '}') {
+                break;
+            }
+            abort_if(p >= end || *p != '"', "%s:%d: expected a key\n", m_source, m_line);
+            parse_json_string(p, end, key);
+
+            skip_space(p, end);
+            abort_if(p >= end || *p != ':', "%s:%d: expected ':'\n", m_source, m_line);
+            p ++;
+            skip_space(p, end);
+
+            const char *k = key.c_str();
+            if (strcmp(k, "label") == 0 || strcmp(k, "key") == 0) {
+                abort_if(p >= end || *p != '"', "%s:%d: label must be a string\n", m_source, m_line);
+                parse_json_string(p, end, m_name);
+                has_name = true;
+            }
+            else if (strcmp(k, "value") == 0) {
+                abort_if(p >= end || *p != '"', "%s:%d: value must be a string\n", m_source, m_line);
+                parse_json_string(p, end, m_value);
+                m_has_value = true;
+            }
+            else if (strcmp(k, "extra") == 0) {
+                abort_if(p >= end || *p != '"', "%s:%d: extra must be a string\n", m_source, m_line);
+                parse_json_string(p, end, m_extra);
+                m_has_extra = true;
+            }
+            else if (strcmp(k, "op") == 0) {
+                abort_if(p >= end || *p != '"', "%s:%d: op must be a string\n", m_source, m_line);
+                parse_json_string(p, end, key);
+                const char *op = key.c_str();
+                abort_if(strcmp(op, "remove") != 0 && strcmp(op, "add") != 0 && strcmp(op, "change") != 0 &&
+                    strcmp(op, "step") != 0,
+                    "%s:%d: unknown op [%s]\n", m_source, m_line, op);
+                m_remove = strcmp(op, "remove") == 0;
+                m_step = strcmp(op, "step") == 0;
+            }
+            else {
+                skip_json_value(p, end, key);
+            }
+
+            skip_space(p, end);
+            if (p < end && *p == ',') {
+                p ++;
+                continue;
+            }
+            abort_if(p >= end || *p != '}', "%s:%d: expected ',' or '}'\n", m_source, m_line);
+            break;
+        }
+
+        abort_if(! has_name && ! m_step, "%s:%d: missing \"label\"\n", m_source, m_line);
+    }
+
+public:
+
+    explicit csf_importer(csf_file& file) : m_file(file), m_source(""), m_line(0),
+        m_has_value(false), m_has_extra(false), m_remove(false), m_step(false), m_label(nullptr),
+        m_label_num(0), m_string_num(0), m_remove_num(0)
+    {
+    }
+
+
+    void import_file(const char *file_name, int format = FORMAT_AUTO)
+    {
+        mapped_file f(file_name);
+        auto data = (const char*) f.data();
+        const char *end = data + f.size();
+
+        if (format == FORMAT_AUTO) {
+            format = guess_format(file_name, f.data(), f.size());
+        }
+
+        m_source = file_name;
+        m_line = 0;
+        m_label = nullptr;
+
+        // 跳过 UTF-8 BOM
+        if (end - data >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0) {
+            data += 3;
+        }
+
+        for (const char *p = data; p < end; ) {
+            const char *eol = (const char*) memchr(p, '\n', end - p);
+            const char *next = eol ? eol + 1 : end;
+            if (eol == nullptr) eol = end;
+            if (eol > p && eol[-1] == '\r') eol --;
+
+            m_line ++;
+            if (eol > p) {
+                if (format == FORMAT_JSON) {
+                    parse_json(p, eol);
+                } else {
+                    parse_tsv(p, eol);
+                }
+                add_line();
+            }
+            p = next;
+        }
+    }
+
+
+    int label_num() { return m_label_num; }
+
+    int string_num() { return m_string_num; }
+
+    int remove_num() { return m_remove_num; }
+};
+
+};
+
+#endif
@@ -0,0 +1,115 @@
+
+
+#ifndef _CSF_INTERN_HPP
+#define _CSF_INTERN_HPP
+
+
+#include "arena.hpp"
+#include "buffer.hpp"
+#include "string_utils.hpp"
+
+
+namespace csf
+{
+
+// 编码后的 value/extra 内容的去重池，相同的字节只在 arena 中保存一份。
+//
+// string 的内容从不原地修改，set_value/set_extra 总是指向新的内容，
+// 所以共享同一份字节的 string 之间天然是写时复制的，修改一个不会影响其它的
+class intern_pool
+{
+private:
+    arena& m_arena;
+    hashmap m_map;          // str_view -> 内容，key 本身也分配在 arena 中
+    buffer m_scratch;
+
+    size_t m_hits;          // 命中已有内容的次数
+    size_t m_saved;         // 因此少分配的字节数
+    size_t m_stored;        // 池中内容的总字节数
+
+
+    static int hash(const str_view *v)
+    {
+        uint64_t h = string_utils::hash64(v->ptr, v->len);
+        return (int) (h ^ (h >> 32));
+    }
+
+public:
+
+    // 是否启用去重，关闭时 intern 退化为直接拷贝到 arena
+    static bool& enabled()
+    {
+        static bool on = true;
+        return on;
+    }
+
+
+    explicit intern_pool(arena& a) : m_arena(a), m_hits(0), m_saved(0), m_stored(0)
+    {
+        hashmap_options ops = {
+            .capacity = 1024,
+            .load_factor = 0.75f,
+            .access_order = 0,
+            .hash = (int (*)(const void*)) hash,
+            .cmp = (int (*)(const void*, const void*)) string_utils::compare_view,
+        };
+        hashmap_setup(&m_map, &ops);
+    }
+
+    intern_pool(const intern_pool&) = delete;
+    intern_pool& operator=(const intern_pool&) = delete;
+
+    ~intern_pool() { hashmap_destroy(&m_map); }
+
+
+    arena& get_arena() { return m_arena; }
+
+
+    // 编码时使用的临时空间，在下一次 scratch 之前有效
+    uint8_t* scratch(size_t len)
+    {
+        m_scratch.clear();
+        return (uint8_t*) m_scratch.reserve(len);
+    }
+
+
+    // 返回与 src 内容相同、生命周期与 arena 相同的字节
+    const uint8_t* intern(const void *src, size_t len)
+    {
+        if (len == 0) {
+            return nullptr;
+        }
+        if (! enabled()) {
+            return m_arena.copy(src, len);
+        }
+
+        str_view key = { (const char*) src, len };
+        auto found = (const uint8_t*) hashmap_get(&m_map, &key);
+        if (found != nullptr) {
+            m_hits ++;
+            m_saved += len;
+            return found;
+        }
+
+        const uint8_t *dst = m_arena.copy(src, len);
+        auto k = m_arena.create<str_view>();
+        k->ptr = (const char*) dst;
+        k->len = len;
+        hashmap_put(&m_map, k, dst, nullptr);
+        m_stored += len;
+        return dst;
+    }
+
+
+    int size() { return m_map.size; }
+
+    size_t hits() { return m_hits; }
+
+    size_t saved() { return m_saved; }
+
+    size_t stored() { return m_stored; }
+};
+
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef _CSF_JOURNAL_HPP
+#define _CSF_JOURNAL_HPP
+
+
+#include "csf.hpp"
+#include "export.hpp"
+#include <unordered_map>
+#include <vector>
+
+
+namespace csf
+{
+
+// 编辑会话的追加日志 (FILE.journal)，每条命令结束后写入这个 step 修改过的 label 的最终内容，
+// 格式与 diff 的补丁相同，import 可以直接重放：
+//
+//   {"op": "change", "label": "...", "value": "...", "extra": "..."}
+//   {"op": "remove", "label": "..."}
+//   {"op": "step", "desc": "insert"}
+//
+// 每行都是完整的最终状态，重复导入的结果不变。step 行让 import 把前后两个 step 中的同名 label
+// 分开处理。undo/redo 也作为 step 写入。保存到 FILE 之后日志被清空
+class csf_journal
+{
+private:
+    FILE *m_fp;
+    std::string m_name;
+
+    buffer m_line;
+    buffer m_text;
+
+
+    void append(const char *s) { m_line.append(s, strlen(s)); }
+
+    void append_field(const char *key, const char *p, size_t len)
+    {
+        append(", \"");
+        append(key);
+        append("\": \"");
+        csf_exporter::escape_json(p, len, m_line);
+        append("\"");
+    }
+
+    void begin_line(const char *op, const str_view *name)
+    {
+        append("{\"op\": \"");
+        append(op);
+        append("\"");
+        append_field("label", name->ptr, name->len);
+    }
+
+    // label 为 nullptr 表示 name 被删除
+    void append_label(const str_view *name, csf_label *label)
+    {
+        if (label == nullptr) {
+            begin_line("remove", name);
+            append("}\n");
+            return;
+        }
+
+        const int n = label->size();
+        if (n == 0) {
+            begin_line("change", name);
+            append("}\n");
+        }
+        for (int i = 0; i < n; i++) {
+            csf_string *str = label->get(i);
+            begin_line("change", name);
+
+            m_text.clear();
+            str->get_value(m_text);
+            append_field("value", m_text.data(), m_text.size());
+
+            int len = 0;
+            const char *extra = str->get_extra(&len);
+            if (extra != nullptr) {
+                append_field("extra", extra, len);
+            }
+            append("}\n");
+        }
+    }
+
+public:
+
+    static std::string path_of(const char *csf_name)
+    {
+        return std::string(csf_name) + ".journal";
+    }
+
+    // 是否为打开的文件写日志，本次会话之后打开的文件都使用这个设置
+    static bool& enabled()
+    {
+        static bool on = false;
+        return on;
+    }
+
+    // 日志中有上次会话没有保存的内容时返回其大小
+    static long pending(const char *csf_name)
+    {
+        struct stat s;
+        if (stat(path_of(csf_name).c_str(), &s) != 0) {
+            return 0;
+        }
+        return (long) s.st_size;
+    }
+
+
+    explicit csf_journal(const char *csf_name) : m_name(path_of(csf_name))
+    {
+        m_fp = fopen(m_name.c_str(), "ab");
+        abort_if(m_fp == nullptr, "can't open journal %s\n", m_name.c_str());
+    }
+
+    csf_journal(const csf_journal&) = delete;
+    csf_journal& operator=(const csf_journal&) = delete;
+
+    ~csf_journal()
+    {
+        if (m_fp) fclose(m_fp);
+    }
+
+
+    // 写入一个 step。同一个 step 中多次修改的名称只写最后的状态，按第一次修改的顺序
+    void append_step(const char *desc, const std::vector<csf_file::delta>& deltas)
+    {
+        abort_if(m_fp == nullptr, "journal %s is closed\n", m_name.c_str());
+
+        std::unordered_map<std::string, csf_label*> last;
+        std::vector<const str_view*> order;
+        for (auto& d : deltas) {
+            const str_view *k = (d.before ? d.before : d.after)->key();
+            auto ret = last.emplace(std::string(k->ptr, k->len), d.after);
+            if (ret.second) {
+                order.push_back(k);
+            } else {
+                ret.first->second = d.after;
+            }
+        }
+
+        m_line.clear();
+        for (const str_view *k : order) {
+            append_label(k, last[std::string(k->ptr, k->len)]);
+        }
+        append("{\"op\": \"step\"");
+        append_field("desc", desc, strlen(desc));
+        append("}\n");
+
+        bool ok = fwrite(m_line.data(), 1, m_line.size(), m_fp) == m_line.size() && fflush(m_fp) == 0;
+        abort_if(! ok, "can't write journal %s\n", m_name.c_str());
+
+        // 与保存使用相同的 fsync 策略
+        if (file_writer::fsync_policy() >= file_writer::FSYNC_FILE) {
+#ifdef _WIN32
+            _commit(_fileno(m_fp));
+#else
+            abort_if(fsync(fileno(m_fp)) != 0, "can't fsync journal %s\n", m_name.c_str());
+#endif
+        }
+    }
+
+    // 内容已经保存，清空日志
+    void truncate()
+    {
+        abort_if(m_fp == nullptr, "journal %s is closed\n", m_name.c_str());
+        m_fp = freopen(m_name.c_str(), "wb", m_fp);
+        abort_if(m_fp == nullptr, "can't truncate journal %s\n", m_name.c_str());
+    }
+
+    // 关闭时删除日志，保留时表示还有没有保存的修改
+    void discard()
+    {
+        if (m_fp) fclose(m_fp);
+        m_fp = nullptr;
+        ::remove(m_name.c_str());
+    }
+};
+
+};
+
+#endif
@@ -6,10 +6,23 @@
 
 
 #include "string.hpp"
-#include <vector>
+#include "string_utils.hpp"
 
 namespace csf
 {
+
+class csf_label;
+
+// label 的 string 发生增删改时得到通知，用于维护全文索引等派生数据
+class label_listener
+{
+public:
+    virtual ~label_listener() { }
+
+    virtual void on_label_changed(csf_label *label) = 0;
+};
+
+
 class csf_label
 {
 
@@ -17,95 +30,266 @@ private:
     static const uint32_t MAGIC = 0x4c424c20;
     static const uint32_t MAX_NAME_LEN = 255;
 
-    uint32_t m_name_len;
-    uint8_t m_name[MAX_NAME_LEN + 1];
+    // m_name 指向映射的文件，或者在 set_name 之后指向 m_arena，
+    // 它不保证以 '\0' 结尾
+    str_view m_name;
+    arena *m_arena;
 
-    std::vector<csf_string*> m_strings;
+    // label 和 string 都分配在 m_arena 中，随所属的 csf_file 一起释放，不需要逐个 delete
+    csf_string **m_strings;
+    uint32_t m_size;
+    uint32_t m_capacity;
 
-public:
+    // 由所属的 csf_file 设置，副本不继承
+    label_listener *m_listener;
+
+    // m_raw 指向文件中完整的 label (从 magic 开始)，只要内容没有被修改过就一直有效，
+    // 保存时原样写回这段字节。m_lazy 表示 string 还没有创建，第一次被访问时才解析
+    const uint8_t *m_raw;
+    uint32_t m_raw_len;
+    uint32_t m_raw_strings;
+    bool m_lazy;
+
+    void materialize()
+    {
+        if (! m_lazy) {
+            return;
+        }
+        m_lazy = false;
+        read_raw_strings(m_raw, m_raw_len, m_name.len, m_raw_strings);
+    }
 
-    csf_label() : m_name_len(0) { m_name[0] = '\0'; }
+    // 从原始字节中解析出 string，追加到末尾
+    void read_raw_strings(const uint8_t *raw, uint32_t len, size_t name_len, uint32_t n)
+    {
+        file_reader r(raw, len);
+
+        // 跳过已经解析过的 magic、string 数量、名称
+        r.read_view(12 + name_len);
+        reserve(m_size + n);
+        for (uint32_t i = 0; i < n; i++) {
+            csf_string *str = m_arena->create<csf_string>();
+            str->read_from_file(r);
+            m_strings[m_size ++] = str;
+        }
+    }
 
-    ~csf_label()
+    // 旧的数组留在 arena 中，只有编辑时才会扩容，浪费的空间可以忽略
+    void reserve(uint32_t n)
     {
-        for (auto p : m_strings) {
-            delete p;
+        if (n <= m_capacity) {
+            return;
         }
+        uint32_t capacity = m_capacity < 4 ? 4 : m_capacity;
+        while (capacity < n) capacity <<= 1;
+
+        auto strings = (csf_string**) m_arena->alloc(sizeof(csf_string*) * capacity);
+        if (m_size > 0) memcpy(strings, m_strings, sizeof(csf_string*) * m_size);
+        m_strings = strings;
+        m_capacity = capacity;
+    }
+
+    void insert_at(int idx, csf_string *str)
+    {
+        abort_if(idx < 0 || (uint32_t) idx > m_size, "string index %d out of range %u\n", idx, m_size);
+        reserve(m_size + 1);
+        memmove(m_strings + idx + 1, m_strings + idx, sizeof(csf_string*) * (m_size - idx));
+        m_strings[idx] = str;
+        m_size ++;
+    }
+
+    void changed()
+    {
+        m_raw = nullptr;
+        if (m_listener) m_listener->on_label_changed(this);
+    }
+
+public:
+
+    explicit csf_label(arena *a) : m_arena(a), m_strings(nullptr), m_size(0), m_capacity(0),
+        m_listener(nullptr), m_raw(nullptr), m_raw_len(0), m_raw_strings(0), m_lazy(false)
+    {
+        m_name.ptr = "";
+        m_name.len = 0;
     }
 
-    csf_label(const csf_label& o)
+    csf_label(const csf_label& o) : csf_label(o, o.m_arena) { }
+
+    // 在 a 中创建副本。a 与 o 的 arena 不同时 (例如来自另一个文件)，
+    // 名称和内容也一起拷贝，副本不再依赖 o 所在的文件
+    csf_label(const csf_label& o, arena *a) : csf_label(a)
     {
-        m_name_len = o.m_name_len;
-        memcpy(m_name, o.m_name, m_name_len + 1);
+        const bool same = a == o.m_arena;
+
+        m_name = o.m_name;
+        if (same) {
+            m_raw = o.m_raw;
+            m_raw_len = o.m_raw_len;
+            m_raw_strings = o.m_raw_strings;
+            m_lazy = o.m_lazy;
+        }
+        else {
+            m_name.ptr = (const char*) a->copy(o.m_name.ptr, o.m_name.len);
+            if (m_name.ptr == nullptr) m_name.ptr = "";
+            if (o.m_lazy) {
+                read_raw_strings(o.m_raw, o.m_raw_len, o.m_name.len, o.m_raw_strings);
+            }
+        }
 
-        for (auto p : o.m_strings) {
-            m_strings.push_back(new csf_string(*p));
+        reserve(m_size + o.m_size);
+        for (uint32_t i = 0; i < o.m_size; i++) {
+            csf_string *str = a->create<csf_string>(*o.m_strings[i]);
+            m_strings[m_size ++] = str;
         }
+        if (! same) {
+            for (uint32_t i = 0; i < m_size; i++) m_strings[i]->copy_to(*a);
+        }
+    }
+
+    // 接管 o 的 string 数组和原始字节，o 变成一个空的 label，不拷贝任何 string
+    csf_label(csf_label&& o) : csf_label(o.m_arena)
+    {
+        m_name = o.m_name;
+        m_strings = o.m_strings;
+        m_size = o.m_size;
+        m_capacity = o.m_capacity;
+        m_raw = o.m_raw;
+        m_raw_len = o.m_raw_len;
+        m_raw_strings = o.m_raw_strings;
+        m_lazy = o.m_lazy;
+
+        o.m_strings = nullptr;
+        o.m_size = o.m_capacity = 0;
+        o.m_raw = nullptr;
+        o.m_lazy = false;
+    }
+
+    csf_label& operator=(const csf_label&) = delete;
+
+
+    arena* get_arena() { return m_arena; }
+
+
+    int size() { return m_lazy ? (int) m_raw_strings : (int) m_size; }
+
+
+    // string 是否还没有被创建过
+    bool is_lazy() { return m_lazy; }
+
+
+    // 内容没有被修改过时返回 true，并给出文件中原始字节的位置
+    bool raw_span(const uint8_t **p_raw, uint32_t *p_len)
+    {
+        *p_raw = m_raw;
+        *p_len = m_raw_len;
+        return m_raw != nullptr;
     }
 
 
-    int size() { return m_strings.size(); }
+    // 直接修改了 get() 返回的 string 之后调用，使原始字节失效并通知 listener
+    void touch() { materialize(); changed(); }
 
 
-    csf_string* get(int idx) { return m_strings.at(idx); }
+    csf_string* get(int idx)
+    {
+        materialize();
+        abort_if(idx < 0 || (uint32_t) idx >= m_size, "string index %d out of range %u\n", idx, m_size);
+        return m_strings[idx];
+    }
 
 
+    // set/add 只拷贝 string 的头部 (长度和指针)，内容本身不拷贝。
+    // 被替换的 string 留在 arena 中，随 csf_file 一起释放
     void set(int idx, csf_string *src)
     {
-        const csf_string& o = *src;
-        csf_string *dst = new csf_string(o);
-        m_strings[idx] = dst;
+        materialize();
+        abort_if(idx < 0 || (uint32_t) idx >= m_size, "string index %d out of range %u\n", idx, m_size);
+        m_strings[idx] = m_arena->create<csf_string>(*src);
+        changed();
     }
 
     void add(int idx, csf_string *src)
     {
-        const csf_string& o = *src;
-        csf_string *dst = new csf_string(o);
-
-        // printf("[%p] m_value_len[%d], m_extra_len[%d]\n", dst, dst->m_value_len, dst->m_extra_len);
+        materialize();
+        insert_at(idx, m_arena->create<csf_string>(*src));
+        changed();
+    }
 
-        m_strings.insert(m_strings.begin() + idx, dst);
+    // 在 idx 处直接创建一个空的 string，由调用者设置内容，避免先构造再拷贝。
+    // listener 在设置内容之前就会收到通知，因此它应该延迟到使用时再读取内容
+    csf_string* emplace(int idx)
+    {
+        materialize();
+        csf_string *str = m_arena->create<csf_string>();
+        insert_at(idx, str);
+        changed();
+        return str;
     }
 
     void remove(int idx)
     {
-        m_strings.erase(m_strings.begin() + idx);
+        materialize();
+        abort_if(idx < 0 || (uint32_t) idx >= m_size, "string index %d out of range %u\n", idx, m_size);
+        memmove(m_strings + idx, m_strings + idx + 1, sizeof(csf_string*) * (m_size - idx - 1));
+        m_size --;
+        changed();
     }
 
+
+    void set_listener(label_listener *listener) { m_listener = listener; }
+
     csf_string** children(int *p_size)
     {
-        const int N = m_strings.size();
+        materialize();
+        const int N = m_size;
         csf_string **tables = new csf_string*[N];
-
-        int i = 0;
-        for (auto p : m_strings) {
-            tables[i ++] = p;
-        }
+        if (N > 0) memcpy(tables, m_strings, sizeof(csf_string*) * N);
 
         if (p_size) *p_size = N;
         return tables;
     }
 
-    const char *name() { return (char*) m_name; }
+    // 返回的名称不以 '\0' 结尾，需要配合 p_len 使用
+    const char *name(int *p_len = nullptr)
+    {
+        if (p_len) *p_len = m_name.len;
+        return m_name.ptr;
+    }
+
+
+    // 作为 hashmap 的 key
+    const str_view* key() { return &m_name; }
 
 
     void set_name(const char *name) 
     {
-        int n;
-        if (name == nullptr || (n = strlen(name)) == 0) {
-            m_name[0] = '\0';
-            m_name_len = 0;
+        set_name(name, name == nullptr ? 0 : strlen(name));
+    }
+
+    void set_name(const char *name, size_t n)
+    {
+        // 名称改变后原始字节不再有效
+        materialize();
+        m_raw = nullptr;
+
+        if (n == 0) {
+            m_name.ptr = "";
+            m_name.len = 0;
             return;
         }
-        abort_if(n > MAX_NAME_LEN, "name length too long %d, max is %d\n", n, MAX_NAME_LEN);
+        abort_if(n > MAX_NAME_LEN, "name length too long %d, max is %d\n", (int) n, MAX_NAME_LEN);
 
-        memcpy(m_name, name, n + 1);
-        m_name_len = n;
+        m_name.ptr = (const char*) m_arena->copy(name, n);
+        m_name.len = n;
     }
 
 
-    void read_from_file(file_reader& r)
+    // lazy 为 true 时只校验并记录 string 所在的字节范围，不创建 csf_string
+    void read_from_file(file_reader& r, bool lazy = false)
     {
+        const unsigned long begin = r.where();
+        const uint8_t *raw = r.read_view(0);
+
         uint32_t magic = r.read_int();
         abort_if(magic != MAGIC, "invalid csf_label magic: %#x at %#x, expected %#x\n",
             magic, r.where(), MAGIC);
@@ -113,35 +297,100 @@ public:
         uint32_t string_len = r.read_int();
 
 
-        m_name_len = r.read_int();
-        abort_if(m_name_len > MAX_NAME_LEN, "too long name length: %u at %#x, max is %u\n",
-            m_name_len, r.where(), MAX_NAME_LEN);
-        r.read_bytes(m_name, m_name_len);
-        m_name[m_name_len] = '\0';
+        uint32_t name_len = r.read_int();
+        abort_if(name_len > MAX_NAME_LEN, "too long name length: %u at %#x, max is %u\n",
+            name_len, r.where(), MAX_NAME_LEN);
+        m_name.ptr = (const char*) r.read_view(name_len);
+        m_name.len = name_len;
 
-        for (auto p : m_strings) delete p;
-        m_strings.clear();
+        m_size = 0;
+        m_lazy = lazy;
 
-        for (int i = 0; i < string_len; i++) {
-            csf_string *str = new csf_string();
-            str->read_from_file(r);
-            m_strings.push_back(str);
+        if (lazy) {
+            csf_string str;
+            for (uint32_t i = 0; i < string_len; i++) {
+                str.read_from_file(r);
+            }
+        }
+        else {
+            reserve(string_len);
+            for (uint32_t i = 0; i < string_len; i++) {
+                csf_string *str = m_arena->create<csf_string>();
+                str->read_from_file(r);
+                m_strings[m_size ++] = str;
+            }
+        }
+        m_raw = raw;
+        m_raw_len = r.where() - begin;
+        m_raw_strings = string_len;
+    }
+
+    // 长度为 len 的 label 能否容纳长度为 name_len 的名称，不读取 label 的内容
+    static bool check_span(uint32_t len, uint32_t name_len)
+    {
+        return len >= 12 && name_len <= MAX_NAME_LEN && name_len <= len - 12;
+    }
+
+    // raw 的开头是否像一个名称长度为 name_len 的完整 label：magic 正确且名称没有越界，不检查 string
+    static bool check_raw(const uint8_t *raw, uint32_t len, uint32_t name_len)
+    {
+        if (! check_span(len, name_len)) {
+            return false;
+        }
+        uint32_t magic, n;
+        memcpy(&magic, raw, sizeof(magic));
+        memcpy(&n, raw + 8, sizeof(n));
+        return magic == MAGIC && n == name_len;
+    }
+
+    // 直接使用已知的原始字节创建 lazy 的 label，不读取 raw，也不做任何校验。
+    // 调用者保证 name_len <= len - 12，并且 raw 是一个完整合法的 label，例如来自与文件一致的缓存
+    void assign_raw(const uint8_t *raw, uint32_t len, uint32_t name_len, uint32_t strings)
+    {
+        m_name.ptr = (const char*) raw + 12;
+        m_name.len = name_len;
+
+        m_size = 0;
+        m_lazy = true;
+        m_raw = raw;
+        m_raw_len = len;
+        m_raw_strings = strings;
+    }
+
+    // 只校验并跳过一个 label，不创建任何对象，用于并行加载前的扫描
+    static void skip(file_reader& r)
+    {
+        uint32_t magic = r.read_int();
+        abort_if(magic != MAGIC, "invalid csf_label magic: %#x at %#x, expected %#x\n",
+            magic, r.where(), MAGIC);
+
+        uint32_t string_len = r.read_int();
+
+        uint32_t name_len = r.read_int();
+        abort_if(name_len > MAX_NAME_LEN, "too long name length: %u at %#x, max is %u\n",
+            name_len, r.where(), MAX_NAME_LEN);
+        r.read_view(name_len);
+
+        csf_string str;
+        for (uint32_t i = 0; i < string_len; i++) {
+            str.read_from_file(r);
         }
     }
 
     void write_to_file(file_writer& w)
     {
-        w.write_bytes(MAGIC);
-        w.write_bytes((uint32_t) m_strings.size()); // [1]
-        w.write_bytes(m_name_len);
-        w.write_bytes(m_name, m_name_len);
+        if (m_raw != nullptr) {
+            w.write_bytes(m_raw, m_raw_len);
+            return;
+        }
 
-        // [1]: vector.size() 返回值为 size_type，
-        // 必须将其强制转化为 32 位类型
+        w.write_bytes(MAGIC);
+        w.write_bytes(m_size);
+        w.write_bytes((uint32_t) m_name.len);
+        w.write_bytes(m_name.ptr, m_name.len);
 
-        for (auto p : m_strings) {
-            // printf("[write_to_file][%p]\n", p);
-            p->write_to_file(w);
+        for (uint32_t i = 0; i < m_size; i++) {
+            m_strings[i]->write_to_file(w);
         }
     }
 };
@@ -2,10 +2,15 @@
 
 #include "csf.hpp"
 #include "cmdline.hpp"
+#include "import.hpp"
+#include "export.hpp"
+#include "matcher.hpp"
+#include "cache.hpp"
+#include "diff.hpp"
+#include "merge.hpp"
+#include "journal.hpp"
 #include <limits.h>
 #include <unistd.h>
-#include <locale.h>
-#include <regex>
 
 #define VERSION "0.1"
 
@@ -14,10 +19,22 @@ using namespace csf;
 
 
 
+static int open_file(const char *file_name, bool lazy = false, bool cache = false, bool verify = false);
+
 static int cmd_open(cmdline& cmd);
+static int cmd_overlay(cmdline& cmd);
 static int cmd_insert(cmdline& cmd);
 static int cmd_remove(cmdline& cmd);
 static int cmd_list(cmdline& cmd);
+static int cmd_search(cmdline& cmd);
+static int cmd_stats(cmdline& cmd);
+static int cmd_import(cmdline& cmd);
+static int cmd_export(cmdline& cmd);
+static int cmd_diff(cmdline& cmd);
+static int cmd_merge(cmdline& cmd);
+static int cmd_undo(cmdline& cmd);
+static int cmd_redo(cmdline& cmd);
+static int cmd_journal(cmdline& cmd);
 static int cmd_save(cmdline& cmd);
 static int cmd_close(cmdline& cmd);
 static int cmd_exit(cmdline& cmd);
@@ -37,12 +54,39 @@ typedef struct
 
 
 static function FUNCTIONS[] = {
-    {cmd_open,      "o",   "open",     " FILE_NAME                                 open a .csf file and close before\n"},
+    {cmd_open,      "o",   "open",     " [--lazy] [--cache [--verify]] [--threads=N] FILE_NAME\n"
+                                        "                                          open a .csf file and close before\n"
+                                        "                                          --cache reopens an unchanged file from FILE.cache,\n"
+                                        "                                          checked by size, mtime, ctime, inode and file header\n"
+                                        "                                          --verify also hashes the whole file, costs a full read\n"},
+    {cmd_overlay,   "ov",  "overlay",  " FILE_NAME...\n"
+                                        "                                          stack .csf files on top of the working one, later files\n"
+                                        "                                          win, labels edited or removed here stay on top\n"
+                                        "                                          like open it can't be undone and clears the undo history\n"},
     {cmd_insert,    "i",   "insert",   " --key=KEY --value=VALUE [--extra=EXTRA]   insert a new label to .csf, and the old will be overrided\n"},
     {cmd_remove,    "r",   "remove",   " KEY                                       remove a key from .csf file\n"
                                         "                                          If no one existed, nothing happened\n"},
-    {cmd_list,      "l",   "list",     " [KEY]                                     list matched regex or all items\n"},
-    {cmd_save,      "s",   "save",     " [FILE_NAME]                               save all items or save as a new .csf file\n"},
+    {cmd_list,      "l",   "list",     " [--explain] [--glob=GLOB | REGEX]         list matched regex or glob, or all items\n"
+                                        "                                          --prefix=P, --from=A, --to=B (A <= name < B) or --sort\n"
+                                        "                                          list in name order through the sorted index\n"},
+    {cmd_search,    "se",  "search",   " [--explain] TEXT                          list labels whose value or extra contains TEXT\n"},
+    {cmd_stats,     "st",  "stats",    "                                           show hash distribution of labels\n"},
+    {cmd_import,    "im",  "import",   " [--format=tsv|json] [--intern=on|off] FILE_NAME\n"
+                                        "                                          import labels from tsv or json lines, one string per line\n"
+                                        "                                          --intern shares identical payloads, sticky for the session\n"},
+    {cmd_export,    "ex",  "export",   " tsv|json|po FILE_NAME                     export all strings as text, - for stdout\n"},
+    {cmd_diff,      "d",   "diff",     " [--stat] A B [PATCH_FILE]                 compare two .csf files, write a json lines patch\n"
+                                        "                                          to PATCH_FILE or stdout, apply it with import\n"},
+    {cmd_merge,     "mg",  "merge",    " [--favor=ours|theirs] [--conflicts=FILE] BASE OURS THEIRS -o OUT\n"
+                                        "                                          three-way merge by label, conflicts are listed as json\n"
+                                        "                                          lines (stdout by default) and fail the command\n"},
+    {cmd_undo,      "u",   "undo",     " [N]                                       undo the last N commands that changed labels\n"
+                                        "                                          since the file was opened or last overlaid\n"},
+    {cmd_redo,      "re",  "redo",     " [N]                                       redo the last N undone commands\n"},
+    {cmd_journal,   "j",   "journal",  " [on|off]                                  log each change to FILE.journal until it is saved,\n"
+                                        "                                          replay a crashed session with import FILE.journal\n"},
+    {cmd_save,      "s",   "save",     " [--fsync=none|file|dir] [FILE_NAME]       save all items or save as a new .csf file, - for stdout\n"
+                                        "                                          written to a temp file and renamed into place\n"},
     {cmd_close,     "c",   "close",    "                                           close the working .csf file\n"},
     {cmd_exit,      "e",   "exit",     "                                           save, close and exit\n"},
     {cmd_quit,      "q",   "quit",     "                                           quit but no save\n"},
@@ -92,17 +136,92 @@ static void usage()
 static csf_file *m_csf_file = nullptr;
 static char csf_path[PATH_MAX + 1];
 
+// 当前文件的编辑日志，没有打开 journal 或者没有文件名时为空
+static std::unique_ptr<csf_journal> m_journal;
 
-int main(int argc, char const *argv[])
+
+static void journal_step(const char *desc, const std::vector<csf_file::delta>& deltas)
 {
-    setlocale(LC_ALL, "");
+    // 日志写不进去不影响编辑本身，停止记录并提示
+    try {
+        m_journal->append_step(desc, deltas);
+    }
+    catch (const csf::error& e) {
+        fprintf(stderr, "%s, journal is off for this file\n", e.what());
+        m_journal.reset();
+    }
+}
 
-    csf_path[0] = '\0';
 
-    hashmap functions;
-    setup_functions(&functions);
+// 一条命令结束，把它对 label 的修改合并为一个可以撤销的 step
+static void end_step(const char *desc)
+{
+    if (m_csf_file == nullptr) {
+        return;
+    }
+    std::vector<csf_file::delta> deltas;
+    if (m_csf_file->commit_step(desc, m_journal ? &deltas : nullptr) && m_journal) {
+        journal_step(desc, deltas);
+    }
+}
+
+
+// 打开文件之后检查上次会话留下的日志，按设置开始记录
+static void attach_journal(const char *file_name)
+{
+    m_journal.reset();
+
+    const long size = csf_journal::pending(file_name);
+    if (size > 0) {
+        printf("%s has %ld bytes of unsaved changes, replay them with: import %s\n",
+            csf_journal::path_of(file_name).c_str(), size, csf_journal::path_of(file_name).c_str());
+    }
+    if (csf_journal::enabled()) {
+        m_journal.reset(new csf_journal(file_name));
+    }
+}
+
+
+// 执行一行命令，返回值 < 0 表示退出，> 0 表示命令执行失败
+static int execute(hashmap *functions, cmdline& cmd, const char **p_name)
+{
+    *p_name = "";
+    if (! cmd.has_next()) {
+        return 0;
+    }
+
+    const char *name = cmd.next();
+    *p_name = name;
+
+    auto function = (int (*)(cmdline&)) hashmap_get(functions, name);
+    if (function == nullptr) {
+        printf("unknown cmdline, type help to show help info\n");
+        return 1;
+    }
 
+    // 失败的命令已经做出的修改同样可以撤销
+    int ret;
+    try {
+        ret = function(cmd);
+    }
+    catch (const csf::error& e) {
+        fprintf(stderr, "%s\n", e.what());
+        ret = 1;
+    }
+    // 例如 std::bad_alloc，只让这一条命令失败，批处理可以继续
+    catch (const std::exception& e) {
+        fprintf(stderr, "%s failed: %s\n", name, e.what());
+        ret = 1;
+    }
+    end_step(name);
+    return ret;
+}
+
+
+static void interactive(hashmap *functions)
+{
     cmdline cmd;
+    const char *name;
 
     do {
         printf("[%s]:$ ", csf_path);
@@ -110,57 +229,265 @@ int main(int argc, char const *argv[])
         if (cmd.read_line()) {
             break;
         }
-        if (! cmd.has_next()) {
+        if (execute(functions, cmd, &name) < 0) {
+            break;
+        }
+    } while (1);
+}
+
+
+// 批处理模式，不打印提示符，出错时报告来源和行号。
+// 返回值 < 0 表示遇到了 exit/quit，> 0 表示有命令失败
+static int run_line(hashmap *functions, cmdline& cmd, const char *source, int line)
+{
+    const char *name;
+    int ret = execute(functions, cmd, &name);
+    if (ret > 0) {
+        fprintf(stderr, "%s:%d: %s failed\n", source, line, name);
+    }
+    return ret;
+}
+
+
+static int run_script(hashmap *functions, const char *file_name, bool keep_going)
+{
+    FILE *fp = strcmp(file_name, "-") == 0 ? stdin : fopen(file_name, "r");
+    if (fp == nullptr) {
+        fprintf(stderr, "can't open script [%s]\n", file_name);
+        return 1;
+    }
+
+    cmdline cmd;
+    int failed = 0;
+    for (int line = 1; ! cmd.read_line(fp); line++) {
+        int ret = run_line(functions, cmd, file_name, line);
+        if (ret < 0) {
+            failed = -1;
+            break;
+        }
+        if (ret > 0) {
+            failed = 1;
+            if (! keep_going) break;
+        }
+    }
+
+    if (fp != stdin) fclose(fp);
+    return failed;
+}
+
+
+// 以 ';' 分隔多条命令，引号中的 ';' 不作为分隔符
+static int run_commands(hashmap *functions, const char *commands, bool keep_going)
+{
+    cmdline cmd;
+    int failed = 0, line = 1;
+
+    for (const char *p = commands, *begin = commands; ; p++) {
+        if (*p == '"') {
+            for (p++; *p && *p != '"'; p++);
+            if (*p == '\0') p--;
+            continue;
+        }
+        if (*p != ';' && *p != '\0') {
             continue;
         }
 
-        // while (cmd.has_next()) {
-        //     int n = 0;
-        //     const char *s = cmd.next(&n);
-        //     printf("[%s][%d]\n", s, n);
-        // }
+        cmd.set_line(begin, p - begin);
+        int ret = run_line(functions, cmd, "-c", line++);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret > 0) {
+            failed = 1;
+            if (! keep_going) break;
+        }
+
+        if (*p == '\0') break;
+        begin = p + 1;
+    }
+    return failed;
+}
+
 
-        auto function = (int (*)(cmdline&)) hashmap_get(&functions, cmd.next());
+static void main_usage(const char *prog)
+{
+    printf("Usage: %s                                   interactive shell\n"
+           "       %s [-k] [-f SCRIPT | -c \"CMD; CMD\"]... [FILE]\n"
+           "  -f SCRIPT  run commands from SCRIPT line by line, - for stdin\n"
+           "  -c CMDS    run commands separated by ';'\n"
+           "  -k         keep going after a failed command\n"
+           "  FILE       open FILE before running the commands\n", prog, prog);
+}
+
+
+int main(int argc, char const *argv[])
+{
+    csf_path[0] = '\0';
 
+    hashmap functions;
+    setup_functions(&functions);
 
-        if (function == nullptr) {
-            printf("unknown cmdline, type help to show help info\n");
+    // 先解析参数，-f 和 -c 按出现的顺序执行
+    bool batch = false, keep_going = false;
+    const char *file_name = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-k") == 0) {
+            keep_going = true;
         }
-        else if (function(cmd) < 0) {
-            break;
+        else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "-c") == 0) && i + 1 < argc) {
+            batch = true;
+            i ++;
+        }
+        else if (argv[i][0] != '-' && file_name == nullptr) {
+            file_name = argv[i];
+        }
+        else {
+            main_usage(argv[0]);
+            hashmap_destroy(&functions);
+            return 2;
         }
+    }
 
-    } while (1);
+    int failed = 0;
+
+    if (file_name != nullptr && open_file(file_name) != 0) {
+        failed = 1;
+    }
+
+    if (! batch) {
+        if (! failed) interactive(&functions);
+    }
+    else {
+        for (int i = 1; i < argc && failed == 0; i++) {
+            if (strcmp(argv[i], "-f") == 0) {
+                failed = run_script(&functions, argv[++i], keep_going);
+            }
+            else if (strcmp(argv[i], "-c") == 0) {
+                failed = run_commands(&functions, argv[++i], keep_going);
+            }
+        }
+    }
+
+    delete m_csf_file;
+    m_csf_file = nullptr;
 
     hashmap_destroy(&functions);
-    return 0;
+    return failed > 0 ? 1 : 0;
 }
 
 
 
+// 打开文件作为当前工作内容，失败时保持未打开的状态
+static int open_file(const char *file_name, bool lazy, bool cache, bool verify)
+{
+    if (access(file_name, R_OK)) {
+        printf("can't open file [%s], is it exist ?\n", file_name);
+        return 1;
+    }
+
+    // 缓存命中时所有 label 都是 lazy 的
+    if (cache && (m_csf_file = csf_cache::load(file_name, verify)) != nullptr) {
+        strncpy(csf_path, file_name, PATH_MAX);
+        attach_journal(file_name);
+        return 0;
+    }
+
+    try {
+        file_reader r(file_name);
+        std::unique_ptr<csf_file> file(new csf_file());
+        file->read_from_file(r, lazy);
+        m_csf_file = file.release();
+    }
+    catch (const csf::error& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    strncpy(csf_path, file_name, PATH_MAX);
+    attach_journal(file_name);
+
+    // 缓存写不进去不影响已经打开的文件
+    if (cache) {
+        try {
+            csf_cache::store(*m_csf_file, file_name);
+        }
+        catch (const csf::error& e) {
+            fprintf(stderr, "can't write cache: %s\n", e.what());
+        }
+    }
+    return 0;
+}
+
+
 int cmd_open(cmdline& cmd)
 {
     // 先尝试关闭当前工作内容
     cmdline dummy;
     cmd_close(dummy);
 
+    bool lazy = false, cache = false, verify = false;
+    while (cmd.has_next() && string_utils::starts_with(cmd.get(), "--")) {
+        const char *arg = cmd.next();
+
+        // --threads=N 修改本次会话之后加载文件使用的线程数，0 表示按 CPU 核数决定
+        if (string_utils::starts_with(arg, "--threads=")) {
+            const char *n = arg + 10;     /* strlen("--threads=") */
+            char *end = nullptr;
+            long threads = strtol(n, &end, 10);
+            if (*n == '\0' || *end != '\0' || threads < 0 || threads > 256) {
+                printf("invalid thread number [%s]\n", n);
+                return 1;
+            }
+            parallel::thread_num() = (int) threads;
+        }
+        // --lazy 只记录每个 label 在文件中的位置，用到时才解析，没有用到的原样写回
+        else if (strcmp(arg, "--lazy") == 0) {
+            lazy = true;
+        }
+        // --cache 使用 FILE.cache 中记录的位置直接创建 label，缓存不存在或者过期时重新生成
+        else if (strcmp(arg, "--cache") == 0) {
+            cache = true;
+        }
+        // --verify 命中缓存前先校验整个文件的内容，用于修改时间和 inode 可能被保留的场合
+        else if (strcmp(arg, "--verify") == 0) {
+            cache = verify = true;
+        }
+        else {
+            printf("unknown option [%s]\n", arg);
+            return 1;
+        }
+    }
+
     if (! cmd.has_next()) {
         printf("you need to append a FILE_NAME param\n");
         return 1;
     }
 
-    const char *file_name = "";
+    return open_file(cmd.next(), lazy, cache, verify);
+}
 
-    if (access((file_name = cmd.next()), R_OK)) {
-        printf("can't open file [%s], is it exist ?\n", file_name);
+int cmd_overlay(cmdline& cmd)
+{
+    if (! cmd.has_next()) {
+        printf("you need to append a FILE_NAME param\n");
         return 1;
     }
 
-    file_reader r(file_name);
-    m_csf_file = new csf_file();
-    m_csf_file->read_from_file(r);
-    strncpy(csf_path, file_name, PATH_MAX);
+    if (m_csf_file == nullptr) {
+        m_csf_file = new csf_file();
+    }
 
+    // 每一层都以 lazy 方式加载，只有被访问或修改的 label 才会解析
+    while (cmd.has_next()) {
+        const char *name = cmd.next();
+        file_reader r(name);
+        std::unique_ptr<csf_file> layer(new csf_file());
+        layer->read_from_file(r, true);
+
+        const int n = layer->size();
+        int replaced = 0;
+        int count = m_csf_file->overlay(std::move(layer), &replaced);
+        printf("%s: %d labels, %d new, %d replaced, %d kept\n", name, n, count - replaced, replaced, n - count);
+    }
     return 0;
 }
 
@@ -185,7 +512,10 @@ int cmd_insert(cmdline& cmd)
         }
 
 
-        csf_label label;
+        arena& a = m_csf_file->get_arena();
+        intern_pool& pool = m_csf_file->get_pool();
+
+        csf_label label(&a);
         label.set_name(key);
 
 
@@ -195,17 +525,16 @@ int cmd_insert(cmdline& cmd)
             value += 8; /* strlen("--value=") */
             cmd.next();
 
-            csf_string str;
-            str.set_value(value);
+            // 直接在 label 中创建 string，内容只编码、拷贝一次
+            csf_string *str = label.emplace(label.size());
+            str->set_value(value, strlen(value), pool);
 
             const char *extra;
             if (cmd.has_next() && string_utils::starts_with(extra = cmd.get(), "--extra=")) {
                 extra += 8; /* strlen("--extra=") */
                 cmd.next();
-                str.set_extra(extra);
+                str->set_extra(extra, strlen(extra), pool);
             }
-
-            label.add(label.size(), &str);
         }
 
         if (label.size() == 0) {
@@ -213,7 +542,7 @@ int cmd_insert(cmdline& cmd)
             return 1;
         }
 
-        m_csf_file->insert(&label);
+        m_csf_file->insert(std::move(label));
     }
 
     return 0;
@@ -236,47 +565,497 @@ int cmd_remove(cmdline& cmd)
     return 0;
 }
 
+// 最近一次 list 使用的匹配器，重复执行同一个查询时不再重新分析和编译
+static std::unique_ptr<matcher> m_last_matcher;
+static bool m_last_glob = false;
+
+static const matcher* get_matcher(const char *pattern, bool glob)
+{
+    if (m_last_matcher == nullptr || m_last_glob != glob || strcmp(m_last_matcher->pattern(), pattern) != 0) {
+        m_last_matcher.reset(new matcher(pattern, glob));
+        m_last_glob = glob;
+    }
+    return m_last_matcher.get();
+}
+
+
+// list 和 search 共用的输出格式，value 是可复用的解码缓冲区
+static void print_label(csf_label *label, buffer& value)
+{
+    int len = 0;
+    const char *name = label->name(&len);
+    printf("[%.*s]\t", len, name);
+
+    int z = 0;
+    csf_string **strings = label->children(&z);
+    for (int j = 0; j < z; j++) {
+        value.clear();
+        strings[j]->get_value(value);
+
+        int extra_len = 0;
+        const char *extra = strings[j]->get_extra(&extra_len);
+
+        printf("[%s]\t[%.*s] ", value.c_str(), extra_len, extra ? extra : "");
+    }
+    delete[] strings;
+    printf("\n");
+}
+
+
 int cmd_list(cmdline& cmd)
 {
     if (m_csf_file == nullptr) {
         return 1;
     }
 
-    std::regex *r = nullptr;
-    if (cmd.has_next()) {
-        r = new std::regex(cmd.next());
+    bool explain = false, sort = false;
+    const char *prefix = nullptr, *from = nullptr, *to = nullptr;
+    const matcher *r = nullptr;
+    while (cmd.has_next()) {
+        const char *arg = cmd.next();
+
+        if (strcmp(arg, "--explain") == 0) {
+            explain = true;
+        }
+        else if (strcmp(arg, "--sort") == 0) {
+            sort = true;
+        }
+        else if (string_utils::starts_with(arg, "--prefix=")) {
+            prefix = arg + 9;                   /* strlen("--prefix=") */
+        }
+        else if (string_utils::starts_with(arg, "--from=")) {
+            from = arg + 7;                     /* strlen("--from=") */
+        }
+        else if (string_utils::starts_with(arg, "--to=")) {
+            to = arg + 5;                       /* strlen("--to=") */
+        }
+        else if (string_utils::starts_with(arg, "--glob=")) {
+            r = get_matcher(arg + 7, true);     /* strlen("--glob=") */
+        }
+        else {
+            r = get_matcher(arg, false);
+        }
+    }
+
+    // 指定了前缀或范围时通过排序索引定位，只遍历命中的区间，结果按名称排序
+    int n = 0, first = 0, last = 0;
+    csf_label **labels = nullptr;
+    csf_label **owned = nullptr;
+
+    if (prefix != nullptr || from != nullptr || to != nullptr || sort) {
+        if (prefix == nullptr && r != nullptr) {
+            prefix = r->literal_prefix();
+        }
+        labels = m_csf_file->sorted(&n);
+        if (prefix != nullptr) {
+            m_csf_file->prefix_range(prefix, &first, &last);
+        } else {
+            m_csf_file->range(from, to, &first, &last);
+        }
+        // 前缀和范围同时指定时取交集
+        if (prefix != nullptr && (from != nullptr || to != nullptr)) {
+            int f = 0, l = 0;
+            m_csf_file->range(from, to, &f, &l);
+            first = first > f ? first : f;
+            last = last < l ? last : l;
+            if (last < first) last = first;
+        }
+    }
+    else {
+        labels = owned = m_csf_file->children(&n);
+        first = 0;
+        last = n;
+    }
+
+    if (explain) {
+        printf("pattern [%s], strategy: %s\n", r ? r->pattern() : "", r ? r->kind_name() : "all");
+        if (owned == nullptr) {
+            printf("sorted index: scanning %d of %d labels\n", last - first, n);
+        }
     }
 
+    buffer value;
 
-    int n = 0;
-    csf_label **labels = m_csf_file->children(&n);
+    for (int i = first; i < last; i++) {
 
-    for (int i = 0; i < n; i++) {
+        int len = 0;
+        const char *name = labels[i]->name(&len);
 
-        if (r && ! std::regex_match(labels[i]->name(), *r)) {
+        if (r && ! r->match(name, len)) {
             continue;
         }
 
+        print_label(labels[i], value);
+    }
+    delete[] owned;
+
+    return 0;
+}
+
+
+int cmd_search(cmdline& cmd)
+{
+    if (m_csf_file == nullptr) {
+        return 1;
+    }
+
+    bool explain = false;
+    if (cmd.has_next() && strcmp(cmd.get(), "--explain") == 0) {
+        cmd.next();
+        explain = true;
+    }
+
+    // 剩余部分以空格连接作为要查找的文本，两端的引号被去掉
+    std::string text;
+    while (cmd.has_next()) {
+        if (! text.empty()) text += ' ';
+        text += cmd.next();
+    }
+    if (text.size() >= 2 && text[0] == '"' && text[text.size() - 1] == '"') {
+        text = text.substr(1, text.size() - 2);
+    }
+    if (text.empty()) {
+        printf("you need to append a TEXT param\n");
+        return 1;
+    }
+
+    text_index& index = m_csf_file->get_text_index();
+
+    std::vector<csf_label*> found;
+    int candidates = index.search(text.data(), text.size(), found);
+
+    if (explain) {
+        printf("%d candidates, %d matched, %lu postings (%lu stale)\n", candidates, (int) found.size(),
+            (unsigned long) index.posted(), (unsigned long) index.stale());
+    }
+
+    buffer value;
+    for (auto label : found) {
+        print_label(label, value);
+    }
+    return 0;
+}
+
+
+int cmd_stats(cmdline& cmd)
+{
+    if (m_csf_file == nullptr) {
+        return 1;
+    }
+
+    hashmap_stat st;
+    m_csf_file->stats(&st);
+
+    // 理想的均匀 hash 下，线性探测查找成功的平均探测数约为 (1 + 1 / (1 - a)) / 2
+    double load = (double) st.size / st.capacity;
+    double expected = (1 + 1 / (1 - load)) / 2;
+
+    printf("labels: %d, slots: %d, load: %.3f, not parsed yet: %d\n", st.size, st.capacity, load,
+        m_csf_file->lazy_count());
+
+    if (m_csf_file->layer_num() > 0) {
+        printf("layers: %d\n", m_csf_file->layer_num());
+    }
+
+    size_t used = 0, reserved = 0;
+    m_csf_file->memory(&used, &reserved);
+    printf("arena: %lu KB used, %lu KB reserved\n", (unsigned long) (used >> 10), (unsigned long) (reserved >> 10));
+
+    intern_pool& pool = m_csf_file->get_pool();
+    printf("interning %s: %d unique payloads, %lu bytes stored, %lu duplicates, %lu bytes saved\n",
+        intern_pool::enabled() ? "on" : "off", pool.size(), (unsigned long) pool.stored(),
+        (unsigned long) pool.hits(), (unsigned long) pool.saved());
+    printf("average probes: %.3f (%.3f expected for a uniform hash), longest probe: %d\n",
+        st.avg_probe, expected, st.max_probe);
+    for (int i = 0; i < 8; i++) {
+        printf("  distance %s%d: %d\n", i == 7 ? ">=" : "", i, st.histogram[i]);
+    }
+    return 0;
+}
+
+
+int cmd_import(cmdline& cmd)
+{
+    int format = csf_importer::FORMAT_AUTO;
+    while (cmd.has_next() && string_utils::starts_with(cmd.get(), "--")) {
+        const char *arg = cmd.next();
+
+        if (string_utils::starts_with(arg, "--format=")) {
+            const char *name = arg + 9;         /* strlen("--format=") */
+
+            if (strcmp(name, "tsv") == 0) {
+                format = csf_importer::FORMAT_TSV;
+            }
+            else if (strcmp(name, "json") == 0) {
+                format = csf_importer::FORMAT_JSON;
+            }
+            else {
+                printf("invalid format [%s], use tsv or json\n", name);
+                return 1;
+            }
+        }
+        // --intern=on|off 修改本次会话之后 import 和 insert 是否对内容去重
+        else if (strcmp(arg, "--intern=on") == 0 || strcmp(arg, "--intern=off") == 0) {
+            intern_pool::enabled() = strcmp(arg, "--intern=on") == 0;
+        }
+        else {
+            printf("unknown option [%s]\n", arg);
+            return 1;
+        }
+    }
+
+    if (! cmd.has_next()) {
+        printf("you need to append a FILE_NAME param\n");
+        return 1;
+    }
+
+    if (m_csf_file == nullptr) {
+        m_csf_file = new csf_file();
+    }
+
+    // 出错时已经导入的行保留在当前工作内容中
+    csf_importer importer(*m_csf_file);
+    importer.import_file(cmd.next(), format);
+
+    printf("imported %d labels, %d strings", importer.label_num(), importer.string_num());
+    if (importer.remove_num() > 0) {
+        printf(", removed %d labels", importer.remove_num());
+    }
+    printf("\n");
+    return 0;
+}
+
+
+int cmd_export(cmdline& cmd)
+{
+    if (m_csf_file == nullptr) {
+        printf("no file opened\n");
+        return 1;
+    }
+
+    if (! cmd.has_next()) {
+        printf("you need to append a FORMAT param, tsv, json or po\n");
+        return 1;
+    }
+    const char *name = cmd.next();
+    int format = csf_exporter::parse_format(name);
+    if (format < 0) {
+        printf("invalid format [%s], use tsv, json or po\n", name);
+        return 1;
+    }
+
+    if (! cmd.has_next()) {
+        printf("you need to append a FILE_NAME param\n");
+        return 1;
+    }
+    const char *file_name = cmd.next();
+
+    file_writer w(file_name);
+    csf_exporter exporter(w, format);
+    exporter.export_file(*m_csf_file);
+    w.commit();
+
+    // 写到标准输出时不附加统计信息，保证输出可以直接被解析
+    if (strcmp(file_name, "-") != 0) {
+        printf("exported %d labels, %d strings\n", exporter.label_num(), exporter.string_num());
+    }
+    return 0;
+}
+
+
+int cmd_diff(cmdline& cmd)
+{
+    bool stat = false;
+    if (cmd.has_next() && strcmp(cmd.get(), "--stat") == 0) {
+        cmd.next();
+        stat = true;
+    }
+
+    const char *names[2];
+    for (int i = 0; i < 2; i++) {
+        if (! cmd.has_next()) {
+            printf("you need to append two FILE_NAME params\n");
+            return 1;
+        }
+        names[i] = cmd.next();
+    }
+    const char *patch = cmd.has_next() ? cmd.next() : "-";
+
+    // 都以 lazy 方式打开，原始字节相同的 label 不需要解析
+    csf_file a, b;
+    {
+        file_reader ra(names[0]);
+        a.read_from_file(ra, true);
+        file_reader rb(names[1]);
+        b.read_from_file(rb, true);
+    }
+
+    csf_diff diff;
+    diff.compare(a, b);
+
+    if (! stat) {
+        file_writer w(patch);
+        diff.write_patch(w);
+        w.commit();
+    }
+
+    // 补丁写到标准输出时不附加统计信息，保证输出可以直接被 import 读取
+    if (stat || strcmp(patch, "-") != 0) {
+        printf("%d added, %d removed, %d changed", diff.count(csf_diff::ADDED),
+            diff.count(csf_diff::REMOVED), diff.count(csf_diff::CHANGED));
+        if (! stat) {
+            printf(" (%d strings)", diff.changed_strings());
+        }
+        printf(", %d unchanged\n", diff.same());
+    }
+    return 0;
+}
+
+
+int cmd_merge(cmdline& cmd)
+{
+    int favor = csf_merge::FAVOR_OURS;
+    const char *conflicts = "-";
+    while (cmd.has_next() && string_utils::starts_with(cmd.get(), "--")) {
+        const char *arg = cmd.next();
+
+        if (strcmp(arg, "--favor=ours") == 0) {
+            favor = csf_merge::FAVOR_OURS;
+        }
+        else if (strcmp(arg, "--favor=theirs") == 0) {
+            favor = csf_merge::FAVOR_THEIRS;
+        }
+        else if (string_utils::starts_with(arg, "--conflicts=")) {
+            conflicts = arg + 12;       /* strlen("--conflicts=") */
+        }
+        else {
+            printf("unknown option [%s]\n", arg);
+            return 1;
+        }
+    }
+
+    const char *names[3];
+    for (int i = 0; i < 3; i++) {
+        if (! cmd.has_next()) {
+            printf("you need to append BASE, OURS and THEIRS params\n");
+            return 1;
+        }
+        names[i] = cmd.next();
+    }
+    if (! cmd.has_next() || strcmp(cmd.next(), "-o") != 0 || ! cmd.has_next()) {
+        printf("you need to append -o OUT\n");
+        return 1;
+    }
+    const char *out = cmd.next();
+
+    csf_file files[3];
+    for (int i = 0; i < 3; i++) {
+        file_reader r(names[i]);
+        files[i].read_from_file(r, true);
+    }
+
+    csf_merge merge(favor);
+    merge.merge(files[0], files[1], files[2]);
 
-        printf("[%s]\t", labels[i]->name());
+    // OUT 可能就是某个输入文件，它们仍然被映射着，file_writer 写完后才 rename 覆盖
+    file_writer w(out);
+    merge.write_result(w, files[1].get_header());
+    w.commit();
 
-        int z = 0;
-        csf_string **strings = labels[i]->children(&z);
-        for (int j = 0; j < z; j++) {
-            char *value = strings[j]->get_value();
-            char *extra = strings[j]->get_extra();
+    const int n = (int) merge.conflicts().size();
+    // 指定了文件时没有冲突也写入，避免留下上一次的结果
+    if (n > 0 || strcmp(conflicts, "-") != 0) {
+        file_writer c(conflicts);
+        merge.write_conflicts(c);
+        c.commit();
+    }
 
-            printf("[%s]\t[%s] ", value, extra);
+    // 冲突写到标准输出时不附加统计信息，保证输出可以直接被解析
+    if (strcmp(conflicts, "-") != 0 || n == 0) {
+        printf("merged %d labels, %d from theirs, %d conflicts\n", merge.label_num(), merge.theirs_num(), n);
+    }
+    return n > 0 ? 1 : 0;
+}
+
+
+// undo 和 redo 的公共部分，N 缺省为 1，一个 step 都没有执行时失败
+static int undo_steps(cmdline& cmd, bool redo)
+{
+    int n = 1;
+    if (cmd.has_next()) {
+        n = atoi(cmd.next());
+        if (n <= 0) {
+            printf("invalid step count, use a positive number\n");
+            return 1;
+        }
+    }
+
+    const char *action = redo ? "redo" : "undo";
+    std::vector<csf_file::delta> applied;
+    int done = 0;
+    for (; m_csf_file != nullptr && done < n; done++) {
+        const char *desc = redo ? m_csf_file->redo(&applied) : m_csf_file->undo(&applied);
+        if (desc == nullptr) {
+            break;
+        }
+        printf("%s %s: %d labels\n", action, desc, (int) applied.size());
 
-            delete[] value;
-            delete[] extra;
+        // 日志中记录的是执行之后的状态，undo/redo 本身也是一个 step
+        if (m_journal) {
+            journal_step((std::string(action) + " " + desc).c_str(), applied);
+        }
+    }
+
+    if (done == 0) {
+        printf("nothing to %s\n", action);
+        return 1;
+    }
+    return 0;
+}
+
+
+int cmd_undo(cmdline& cmd)
+{
+    return undo_steps(cmd, false);
+}
+
+
+int cmd_redo(cmdline& cmd)
+{
+    return undo_steps(cmd, true);
+}
+
+
+int cmd_journal(cmdline& cmd)
+{
+    if (! cmd.has_next()) {
+        printf("journal: %s", csf_journal::enabled() ? "on" : "off");
+        if (m_csf_file != nullptr) {
+            printf(", %d undo, %d redo", m_csf_file->undo_num(), m_csf_file->redo_num());
         }
-        delete[] strings;
         printf("\n");
+        return 0;
     }
-    delete[] labels;
 
-    delete r;
+    const char *arg = cmd.next();
+    if (strcmp(arg, "on") == 0) {
+        // 只记录之后的修改，之前没有保存的修改不在日志中
+        csf_journal::enabled() = true;
+        if (! m_journal && csf_path[0] != '\0') {
+            m_journal.reset(new csf_journal(csf_path));
+        }
+    }
+    else if (strcmp(arg, "off") == 0) {
+        csf_journal::enabled() = false;
+        if (m_journal) {
+            m_journal->discard();
+            m_journal.reset();
+        }
+    }
+    else {
+        printf("invalid journal mode [%s], use on or off\n", arg);
+        return 1;
+    }
     return 0;
 }
 
@@ -287,10 +1066,32 @@ int cmd_save(cmdline& cmd)
         return 0;
     }
 
+    // --fsync=none|file|dir 修改本次会话之后所有保存的 fsync 策略
+    if (cmd.has_next() && string_utils::starts_with(cmd.get(), "--fsync=")) {
+        const char *policy = cmd.next() + 8;    /* strlen("--fsync=") */
+
+        if (strcmp(policy, "none") == 0) {
+            file_writer::fsync_policy() = file_writer::FSYNC_NONE;
+        }
+        else if (strcmp(policy, "file") == 0) {
+            file_writer::fsync_policy() = file_writer::FSYNC_FILE;
+        }
+        else if (strcmp(policy, "dir") == 0) {
+            file_writer::fsync_policy() = file_writer::FSYNC_DIR;
+        }
+        else {
+            printf("invalid fsync policy [%s], use none, file or dir\n", policy);
+            return 1;
+        }
+    }
+
     const char *file_name = "";
     if (cmd.has_next()) {               // 如果指定了参数，另存为这个文件
         file_name = cmd.next();
     }
+    else if (! m_csf_file->is_dirty()) { // 没有修改过，不需要写入
+        return 0;
+    }
     else if (csf_path[0] != '\0') {     // 如果已经打开了文件，保存到原文件
         file_name = csf_path;
     }
@@ -300,9 +1101,24 @@ int cmd_save(cmdline& cmd)
     }
 
 
+    // 写入临时文件后再 rename，中途失败时原文件不受影响
     file_writer w(file_name);
     m_csf_file->write_to_file(w);
-    strncpy(csf_path, file_name, PATH_MAX);
+    w.commit();
+
+    // 写到标准输出时不改变当前的文件
+    if (strcmp(file_name, "-") != 0) {
+        if (file_name != csf_path) {
+            strncpy(csf_path, file_name, PATH_MAX);
+        }
+        m_csf_file->set_clean();
+
+        // 日志跟随保存到的文件，其中的内容都已经写入
+        if (csf_journal::enabled()) {
+            m_journal.reset(new csf_journal(csf_path));
+            m_journal->truncate();
+        }
+    }
 
     return 0;
 }
@@ -314,6 +1130,12 @@ int cmd_close(cmdline& cmd)
     cmdline dummy;
     cmd_save(dummy);
 
+    // 保存成功后不再需要日志
+    if (m_journal && m_csf_file && ! m_csf_file->is_dirty()) {
+        m_journal->discard();
+    }
+    m_journal.reset();
+
     // 析构对象
     delete m_csf_file;
     m_csf_file = nullptr;
@@ -331,7 +1153,11 @@ int cmd_exit(cmdline& cmd)
 
 int cmd_quit(cmdline&)
 {
-    // quit 表示放弃保存，直接退出
+    // quit 表示放弃保存，直接退出，日志也一起丢弃
+    if (m_journal) {
+        m_journal->discard();
+        m_journal.reset();
+    }
     return -1;
 }
 
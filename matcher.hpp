@@ -0,0 +1,311 @@
+
+
+#ifndef _CSF_MATCHER_HPP
+#define _CSF_MATCHER_HPP
+
+
+#include "global.hpp"
+#include <vector>
+#include <regex>
+
+
+namespace csf
+{
+
+// label 名称的匹配器，整个名称必须匹配 (与 std::regex_match 相同)。
+// 构造时分析一次模式，常见的写法不经过 std::regex：
+//
+//   TXT_START          literal     memcmp
+//   NAME:.*            prefix      memcmp
+//   .*_DESC            suffix      memcmp
+//   .*GAPOWR.*         contains    memchr + memcmp
+//   NAME:GA.*.*R       glob        按 '*' 分段逐段查找
+//
+// 只有含字符类、分组、重复等的模式才交给 std::regex，并且只编译一次
+class matcher
+{
+public:
+    static const int ALL        =   0;
+    static const int LITERAL    =   1;
+    static const int PREFIX     =   2;
+    static const int SUFFIX     =   3;
+    static const int CONTAINS   =   4;
+    static const int GLOB       =   5;
+    static const int REGEX      =   6;
+
+private:
+    // 一段不含 '*' 的模式，mask 中为 '?' 的位置匹配任意一个字节
+    struct segment
+    {
+        std::string text;
+        std::string mask;
+        bool any;           // 是否含有 '?'
+    };
+
+    int m_kind;
+    std::string m_pattern;
+
+    // glob 模式按 '*' 切分，m_head/m_tail 表示首尾两段是否锚定在开头和结尾
+    std::vector<segment> m_segments;
+    bool m_head, m_tail;
+
+    std::unique_ptr<std::regex> m_regex;
+
+
+    // 把正则转为 glob 的 token：返回 false 表示含有无法转换的语法
+    static bool regex_to_glob(const char *p, std::string& text, std::string& mask)
+    {
+        static const char META[] = ".^$|?*+()[]{}\\";
+
+        size_t len = strlen(p);
+        if (len > 0 && p[0] == '^') { p++; len--; }
+        if (len > 0 && p[len - 1] == '$' && (len < 2 || p[len - 2] != '\\')) len--;
+
+        for (size_t i = 0; i < len; i++) {
+            char c = p[i];
+            if (c == '\\') {
+                // 只接受转义的标点，\d \w 之类交给 regex
+                if (i + 1 >= len || strchr(META, p[i + 1]) == nullptr) return false;
+                text += p[++i];
+                mask += ' ';
+                continue;
+            }
+            if (c == '.') {
+                bool star = i + 1 < len && p[i + 1] == '*';
+                bool plus = i + 1 < len && p[i + 1] == '+';
+                if (star || plus) {
+                    i++;
+                }
+                if (! star) {
+                    text += '?';
+                    mask += '?';
+                }
+                if (star || plus) {
+                    text += '*';
+                    mask += '*';
+                }
+                continue;
+            }
+            if (strchr(META, c) != nullptr) {
+                return false;
+            }
+            text += c;
+            mask += ' ';
+        }
+        return true;
+    }
+
+
+    // 解析 glob，'\\' 转义下一个字符
+    static void parse_glob(const char *p, std::string& text, std::string& mask)
+    {
+        for (; *p; p++) {
+            if (*p == '\\' && p[1] != '\0') {
+                text += *++p;
+                mask += ' ';
+            }
+            else if (*p == '*' || *p == '?') {
+                text += *p;
+                mask += *p;
+            }
+            else {
+                text += *p;
+                mask += ' ';
+            }
+        }
+    }
+
+
+    void build_glob(const std::string& text, const std::string& mask)
+    {
+        segment seg = { "", "", false };
+        m_head = mask.empty() || mask[0] != '*';
+        m_tail = mask.empty() || mask[mask.size() - 1] != '*';
+
+        for (size_t i = 0; i <= text.size(); i++) {
+            if (i == text.size() || mask[i] == '*') {
+                if (! seg.text.empty()) {
+                    m_segments.push_back(seg);
+                }
+                seg = { "", "", false };
+                continue;
+            }
+            seg.text += text[i];
+            seg.mask += mask[i];
+            seg.any |= mask[i] == '?';
+        }
+
+        // 选择最具体的策略
+        const int n = m_segments.size();
+        const bool plain = n == 1 && ! m_segments[0].any;
+
+        if (n == 0)                             m_kind = m_head && m_tail ? LITERAL : ALL;
+        else if (plain && m_head && m_tail)     m_kind = LITERAL;
+        else if (plain && m_head)               m_kind = PREFIX;
+        else if (plain && m_tail)               m_kind = SUFFIX;
+        else if (plain)                         m_kind = CONTAINS;
+        else                                    m_kind = GLOB;
+    }
+
+
+    static bool segment_at(const segment& seg, const char *p)
+    {
+        if (! seg.any) {
+            return memcmp(p, seg.text.data(), seg.text.size()) == 0;
+        }
+        for (size_t i = 0; i < seg.text.size(); i++) {
+            if (seg.mask[i] != '?' && p[i] != seg.text[i]) return false;
+        }
+        return true;
+    }
+
+
+    // 在 [p, end) 中查找第一个匹配 seg 的位置
+    static const char* find(const segment& seg, const char *p, const char *end)
+    {
+        const size_t n = seg.text.size();
+        if ((size_t) (end - p) < n) {
+            return nullptr;
+        }
+        const char *last = end - n;
+
+        if (seg.any || seg.mask[0] == '?') {
+            for (; p <= last; p++) {
+                if (segment_at(seg, p)) return p;
+            }
+            return nullptr;
+        }
+
+        // 用 memchr 跳到首字节，glibc 中它是向量化的
+        const char first = seg.text[0];
+        while (p <= last) {
+            p = (const char*) memchr(p, first, last - p + 1);
+            if (p == nullptr) {
+                return nullptr;
+            }
+            if (memcmp(p + 1, seg.text.data() + 1, n - 1) == 0) {
+                return p;
+            }
+            p++;
+        }
+        return nullptr;
+    }
+
+
+    bool match_glob(const char *p, const char *end) const
+    {
+        const int n = m_segments.size();
+        if (n == 0) {
+            return ! m_head || p == end;
+        }
+
+        int first = 0, last = n;
+
+        if (m_head) {
+            const segment& s = m_segments[0];
+            if ((size_t) (end - p) < s.text.size() || ! segment_at(s, p)) return false;
+            p += s.text.size();
+            first = 1;
+        }
+        if (m_tail && last > first) {
+            const segment& s = m_segments[n - 1];
+            if ((size_t) (end - p) < s.text.size() || ! segment_at(s, end - s.text.size())) return false;
+            end -= s.text.size();
+            last = n - 1;
+        }
+        else if (m_tail && p != end) {
+            // 只有一段且同时锚定首尾
+            return false;
+        }
+
+        // 中间各段取最左的匹配即可，贪心不会错过解
+        for (int i = first; i < last; i++) {
+            p = find(m_segments[i], p, end);
+            if (p == nullptr) return false;
+            p += m_segments[i].text.size();
+        }
+        return true;
+    }
+
+public:
+
+    // glob 为 true 时 pattern 按 '*' '?' 解释，否则按正则解释
+    matcher(const char *pattern, bool glob = false) : m_kind(ALL), m_pattern(pattern),
+        m_head(true), m_tail(true)
+    {
+        std::string text, mask;
+        if (glob) {
+            parse_glob(pattern, text, mask);
+        }
+        else if (! regex_to_glob(pattern, text, mask)) {
+            m_kind = REGEX;
+            try {
+                m_regex.reset(new std::regex(pattern,
+                    std::regex::ECMAScript | std::regex::optimize | std::regex::nosubs));
+            }
+            catch (const std::regex_error& e) {
+                abort_if(1, "invalid regex [%s]: %s\n", pattern, e.what());
+            }
+            return;
+        }
+        build_glob(text, mask);
+    }
+
+    matcher(const matcher&) = delete;
+    matcher& operator=(const matcher&) = delete;
+
+
+    bool match(const char *name, size_t len) const
+    {
+        const char *end = name + len;
+
+        switch (m_kind) {
+            case ALL:
+                return true;
+            case LITERAL: {
+                if (m_segments.empty()) return len == 0;
+                const std::string& s = m_segments[0].text;
+                return len == s.size() && memcmp(name, s.data(), len) == 0;
+            }
+            case PREFIX: {
+                const std::string& s = m_segments[0].text;
+                return len >= s.size() && memcmp(name, s.data(), s.size()) == 0;
+            }
+            case SUFFIX: {
+                const std::string& s = m_segments[0].text;
+                return len >= s.size() && memcmp(end - s.size(), s.data(), s.size()) == 0;
+            }
+            case CONTAINS:
+                return find(m_segments[0], name, end) != nullptr;
+            case GLOB:
+                return match_glob(name, end);
+            default:
+                return std::regex_match(name, end, *m_regex);
+        }
+    }
+
+
+    // literal 和 prefix 模式的固定前缀，可以交给排序索引缩小范围，其它模式返回 nullptr
+    const char* literal_prefix() const
+    {
+        if ((m_kind == LITERAL || m_kind == PREFIX) && ! m_segments.empty()) {
+            return m_segments[0].text.c_str();
+        }
+        return nullptr;
+    }
+
+
+    const char* pattern() const { return m_pattern.c_str(); }
+
+    int kind() const { return m_kind; }
+
+    const char* kind_name() const
+    {
+        static const char *NAMES[] = { "all", "literal", "prefix", "suffix", "contains", "glob", "regex" };
+        return NAMES[m_kind];
+    }
+};
+
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef _CSF_MERGE_HPP
+#define _CSF_MERGE_HPP
+
+
+#include "csf.hpp"
+#include "diff.hpp"
+#include "export.hpp"
+#include <vector>
+
+
+namespace csf
+{
+
+// label 级别的三方合并。对每个名称比较 base/ours/theirs 三个版本 (不存在视为删除)：
+//
+//   ours == theirs             取 ours (包括双方都删除)
+//   ours == base               取 theirs
+//   theirs == base             取 ours
+//   其它                       冲突，按 favor 取一方并记录下来
+//
+// 先按 ours 的顺序遍历一次，再按 theirs 的顺序遍历 ours 中没有的名称，其余的都是双方都删除的，
+// 每个 label 只在另外两个文件的 hash 表中各查找一次。比较时原始字节相同的 label 不解析，
+// 结果中的 label 直接引用三个文件，写出时没有修改过的 label 原样拷贝
+class csf_merge
+{
+public:
+    static const int FAVOR_OURS     =   0;
+    static const int FAVOR_THEIRS   =   1;
+
+    static const int BOTH_MODIFIED  =   0;
+    static const int BOTH_ADDED     =   1;
+    static const int MODIFY_DELETE  =   2;      // ours 修改，theirs 删除
+    static const int DELETE_MODIFY  =   3;      // ours 删除，theirs 修改
+
+    struct conflict
+    {
+        int kind;
+        csf_label *base;
+        csf_label *ours;
+        csf_label *theirs;
+    };
+
+private:
+    int m_favor;
+    std::vector<csf_label*> m_result;
+    std::vector<conflict> m_conflicts;
+    int m_theirs;           // 结果中取自 theirs 的 label 数
+
+    buffer m_line;
+    buffer m_text;
+
+
+    static bool same(csf_label *x, csf_label *y)
+    {
+        if (x == nullptr || y == nullptr) {
+            return x == y;
+        }
+        return csf_diff::same_label(x, y);
+    }
+
+
+    void resolve(csf_label *b, csf_label *o, csf_label *t)
+    {
+        csf_label *r;
+        if (same(o, t)) {
+            r = o;
+        }
+        else if (same(b, o)) {
+            r = t;
+        }
+        else if (same(b, t)) {
+            r = o;
+        }
+        else {
+            int kind = b == nullptr ? BOTH_ADDED : t == nullptr ? MODIFY_DELETE :
+                o == nullptr ? DELETE_MODIFY : BOTH_MODIFIED;
+            m_conflicts.push_back({ kind, b, o, t });
+            r = m_favor == FAVOR_OURS ? o : t;
+        }
+
+        if (r != nullptr) {
+            m_result.push_back(r);
+            m_theirs += r == t && r != o;
+        }
+    }
+
+
+    void append(const char *s) { m_line.append(s, strlen(s)); }
+
+    void append_string(const char *p, size_t len)
+    {
+        append("\"");
+        csf_exporter::escape_json(p, len, m_line);
+        append("\"");
+    }
+
+    // "key": [{"value": "...", "extra": "..."}, ...]，不存在时为 null
+    void append_side(const char *key, csf_label *label)
+    {
+        append(", \"");
+        append(key);
+        append("\": ");
+        if (label == nullptr) {
+            append("null");
+            return;
+        }
+
+        append("[");
+        for (int i = 0, n = label->size(); i < n; i++) {
+            csf_string *str = label->get(i);
+            m_text.clear();
+            str->get_value(m_text);
+
+            append(i > 0 ? ", {\"value\": " : "{\"value\": ");
+            append_string(m_text.data(), m_text.size());
+
+            int len = 0;
+            const char *extra = str->get_extra(&len);
+            if (extra != nullptr) {
+                append(", \"extra\": ");
+                append_string(extra, len);
+            }
+            append("}");
+        }
+        append("]");
+    }
+
+public:
+
+    explicit csf_merge(int favor = FAVOR_OURS) : m_favor(favor), m_theirs(0)
+    {
+    }
+
+
+    static const char* kind_name(int kind)
+    {
+        static const char *NAMES[] = { "both-modified", "both-added", "modify-delete", "delete-modify" };
+        return NAMES[kind];
+    }
+
+
+    void merge(csf_file& base, csf_file& ours, csf_file& theirs)
+    {
+        m_result.clear();
+        m_conflicts.clear();
+        m_theirs = 0;
+
+        int no = 0, nt = 0;
+        std::unique_ptr<csf_label*[]> lo(ours.children(&no));
+        std::unique_ptr<csf_label*[]> lt(theirs.children(&nt));
+        m_result.reserve(no > nt ? no : nt);
+
+        for (int i = 0; i < no; i++) {
+            int len = 0;
+            const char *name = lo[i]->name(&len);
+            resolve(base.find(name, len), lo[i], theirs.find(name, len));
+        }
+
+        for (int i = 0; i < nt; i++) {
+            int len = 0;
+            const char *name = lt[i]->name(&len);
+            if (ours.find(name, len) == nullptr) {
+                resolve(base.find(name, len), nullptr, lt[i]);
+            }
+        }
+    }
+
+
+    // 合并结果，header 中的其它字段取自 header
+    void write_result(file_writer& w, csf_header& header)
+    {
+        csf_file::write_labels(w, header, m_result.data(), (int) m_result.size());
+    }
+
+
+    // 每个冲突一行 JSON：
+    // {"label": "...", "kind": "both-modified", "resolved": "ours", "base": [...], "ours": [...], "theirs": null}
+    void write_conflicts(file_writer& w)
+    {
+        const char *resolved = m_favor == FAVOR_OURS ? "ours" : "theirs";
+
+        for (auto& c : m_conflicts) {
+            csf_label *any = c.ours ? c.ours : c.theirs;
+            int len = 0;
+            const char *name = any->name(&len);
+
+            m_line.clear();
+            append("{\"label\": ");
+            append_string(name, len);
+            append(", \"kind\": \"");
+            append(kind_name(c.kind));
+            append("\", \"resolved\": \"");
+            append(resolved);
+            append("\"");
+            append_side("base", c.base);
+            append_side("ours", c.ours);
+            append_side("theirs", c.theirs);
+            append("}\n");
+            w.write_bytes(m_line.data(), m_line.size());
+        }
+    }
+
+
+    const std::vector<conflict>& conflicts() { return m_conflicts; }
+
+    int label_num() { return (int) m_result.size(); }
+
+    int theirs_num() { return m_theirs; }
+};
+
+};
+
+#endif
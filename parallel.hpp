@@ -0,0 +1,102 @@
+
+
+#ifndef _CSF_PARALLEL_HPP
+#define _CSF_PARALLEL_HPP
+
+
+#include "global.hpp"
+#include <exception>
+#include <thread>
+#include <vector>
+
+
+namespace csf
+{
+
+// 把 [0, n) 按连续区间分给若干线程执行，调用方负责保证各区间之间没有数据竞争。
+// 每个区间的结果写到各自的位置上，合并时按下标顺序处理即可得到与单线程相同的结果
+class parallel
+{
+private:
+    parallel() = delete;
+
+public:
+
+    // 默认使用的线程数，0 表示按 CPU 核数决定
+    static int& thread_num()
+    {
+        static int n = 0;
+        return n;
+    }
+
+
+    // 实际使用的线程数：每个线程至少分到 min_chunk 个任务，否则不值得创建线程
+    static int threads_for(size_t n, size_t min_chunk)
+    {
+        int threads = thread_num();
+        if (threads <= 0) {
+            threads = (int) std::thread::hardware_concurrency();
+        }
+        if (threads <= 0) {
+            threads = 1;
+        }
+        size_t max = n / (min_chunk ? min_chunk : 1);
+        if ((size_t) threads > max) {
+            threads = max > 0 ? (int) max : 1;
+        }
+        return threads;
+    }
+
+
+    // fn(begin, end, part) 处理 [begin, end)，part 为区间编号。
+    // 任何一个区间抛出的异常会在所有线程结束后重新抛出，多个时取编号最小的。
+    // 保存异常本身而不是拷贝错误信息，内存不足时记录错误不会再次失败。
+    // 无法创建线程时 (例如 --threads 过大) 该区间在当前线程中执行，已经启动的线程照常等待结束
+    template <typename F>
+    static void for_range(size_t n, int threads, F fn)
+    {
+        if (threads <= 1 || n < 2) {
+            fn((size_t) 0, n, 0);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        std::vector<std::exception_ptr> errors(threads);
+        const size_t chunk = (n + threads - 1) / threads;
+        workers.reserve(threads);
+
+        auto run = [&fn, &errors](size_t begin, size_t end, int t) {
+            try {
+                fn(begin, end, t);
+            }
+            catch (...) {
+                errors[t] = std::current_exception();
+            }
+        };
+
+        for (int t = 0; t < threads; t++) {
+            size_t begin = t * chunk;
+            size_t end = begin + chunk < n ? begin + chunk : n;
+            if (begin >= end) {
+                break;
+            }
+            try {
+                workers.emplace_back(run, begin, end, t);
+            }
+            catch (const std::exception&) {          // std::system_error 或 std::bad_alloc
+                run(begin, end, t);
+            }
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+
+        for (auto& e : errors) {
+            if (e) std::rethrow_exception(e);
+        }
+    }
+};
+
+};
+
+#endif
@@ -0,0 +1,248 @@
+
+
+#ifndef _CSF_SEARCH_HPP
+#define _CSF_SEARCH_HPP
+
+
+#include "label.hpp"
+#include "buffer.hpp"
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+
+namespace csf
+{
+
+// string 内容 (解码后的 value 和 extra) 的三元组索引，ASCII 不区分大小写。
+//
+// 每个三元组对应一个 label 列表，只追加不删除：label 被修改或删除后旧的记录留在列表中，
+// 查询时对候选 label 重新校验内容，所以多余的记录只影响速度不影响结果，积累过多时整体重建。
+// label 的修改通知只把它放进待处理队列，下一次查询时才重新解码，
+// 因此 import 这样连续修改同一个 label 的操作只需要解码一次
+class text_index : public label_listener
+{
+private:
+    struct entry
+    {
+        int grams;          // 该 label 当前在各个列表中的记录数
+        bool pending;       // 内容有变化，尚未重新索引
+    };
+
+    std::unordered_map<uint32_t, std::vector<csf_label*>> m_postings;
+    std::unordered_map<csf_label*, entry> m_labels;
+    std::vector<csf_label*> m_pending;
+
+    size_t m_posted;        // 所有列表中记录的总数
+    size_t m_stale;         // 其中已经过期的记录数
+
+    buffer m_text;
+    std::vector<uint32_t> m_grams;
+
+
+    static uint8_t fold(uint8_t c) { return (c >= 'A' && c <= 'Z') ? c + 0x20 : c; }
+
+    static void fold(char *p, size_t len)
+    {
+        for (size_t i = 0; i < len; i++) p[i] = (char) fold((uint8_t) p[i]);
+    }
+
+    static void add_grams(const char *p, size_t len, std::vector<uint32_t>& out)
+    {
+        auto s = (const uint8_t*) p;
+        for (size_t i = 0; i + 3 <= len; i++) {
+            out.push_back((uint32_t) s[i] << 16 | (uint32_t) s[i + 1] << 8 | s[i + 2]);
+        }
+    }
+
+
+    // 把 label 的全部 value 和 extra 依次解码、折叠到 m_text 中，各段以 '\0' 分隔
+    void load_text(csf_label *label)
+    {
+        m_text.clear();
+        for (int i = 0, n = label->size(); i < n; i++) {
+            csf_string *str = label->get(i);
+            str->get_value(m_text);
+            m_text.append("", 1);
+
+            int extra_len = 0;
+            const char *extra = str->get_extra(&extra_len);
+            if (extra != nullptr) {
+                m_text.append(extra, extra_len);
+                m_text.append("", 1);
+            }
+        }
+        fold(m_text.data(), m_text.size());
+    }
+
+
+    void index_label(csf_label *label, entry& e)
+    {
+        load_text(label);
+
+        // 跨越 '\0' 的三元组不会出现在查询中，一起加入也不影响正确性，但没有必要
+        m_grams.clear();
+        const char *p = m_text.data(), *end = p + m_text.size();
+        while (p < end) {
+            auto q = (const char*) memchr(p, '\0', end - p);
+            add_grams(p, q - p, m_grams);
+            p = q + 1;
+        }
+        std::sort(m_grams.begin(), m_grams.end());
+        m_grams.erase(std::unique(m_grams.begin(), m_grams.end()), m_grams.end());
+
+        for (auto g : m_grams) {
+            m_postings[g].push_back(label);
+        }
+        m_stale += e.grams;
+        m_posted += m_grams.size();
+        e.grams = m_grams.size();
+        e.pending = false;
+    }
+
+
+    void rebuild()
+    {
+        m_postings.clear();
+        m_posted = m_stale = 0;
+        for (auto& it : m_labels) {
+            it.second.grams = 0;
+            index_label(it.first, it.second);
+        }
+        m_pending.clear();
+    }
+
+
+    void flush_pending()
+    {
+        for (auto label : m_pending) {
+            auto it = m_labels.find(label);
+            if (it != m_labels.end() && it->second.pending) {
+                index_label(label, it->second);
+            }
+        }
+        m_pending.clear();
+
+        if (m_stale > 4096 && m_stale > m_posted / 2) {
+            rebuild();
+        }
+    }
+
+
+    // needle 已经折叠
+    bool contains(csf_label *label, const char *needle, size_t len)
+    {
+        load_text(label);
+        const char *p = m_text.data(), *end = p + m_text.size();
+        if (len == 0) {
+            return true;
+        }
+        while ((size_t) (end - p) >= len) {
+            p = (const char*) memchr(p, needle[0], end - p - len + 1);
+            if (p == nullptr) {
+                return false;
+            }
+            if (memcmp(p, needle, len) == 0) {
+                return true;
+            }
+            p++;
+        }
+        return false;
+    }
+
+public:
+
+    text_index() : m_posted(0), m_stale(0) { }
+
+    text_index(const text_index&) = delete;
+    text_index& operator=(const text_index&) = delete;
+
+
+    void add(csf_label *label)
+    {
+        auto& e = m_labels[label];
+        if (! e.pending) {
+            e.pending = true;
+            m_pending.push_back(label);
+        }
+    }
+
+    void remove(csf_label *label)
+    {
+        auto it = m_labels.find(label);
+        if (it != m_labels.end()) {
+            m_stale += it->second.grams;
+            m_labels.erase(it);
+        }
+    }
+
+    void on_label_changed(csf_label *label) override
+    {
+        if (m_labels.count(label)) {
+            add(label);
+        }
+    }
+
+
+    // 查找 value 或 extra 中包含 text 的 label，结果按名称排序。
+    // 返回参与校验的候选 label 数，可以用来观察索引的效果
+    int search(const char *text, size_t len, std::vector<csf_label*>& out)
+    {
+        flush_pending();
+        out.clear();
+
+        std::string needle(text, len);
+        fold(&needle[0], len);
+
+        // 不足三个字节时没有可用的三元组，只能逐个校验
+        std::vector<csf_label*> candidates;
+        if (len < 3) {
+            for (auto& it : m_labels) candidates.push_back(it.first);
+        }
+        else {
+            m_grams.clear();
+            add_grams(needle.data(), len, m_grams);
+
+            // 取最短的列表作为候选
+            const std::vector<csf_label*> *best = nullptr;
+            for (auto g : m_grams) {
+                auto it = m_postings.find(g);
+                if (it == m_postings.end()) {
+                    return 0;
+                }
+                if (best == nullptr || it->second.size() < best->size()) {
+                    best = &it->second;
+                }
+            }
+            candidates = *best;
+
+            // 去掉重复和已经删除的 label
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+            candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+                [this](csf_label *l) { return m_labels.count(l) == 0; }), candidates.end());
+        }
+
+        for (auto label : candidates) {
+            if (contains(label, needle.data(), len)) {
+                out.push_back(label);
+            }
+        }
+
+        std::sort(out.begin(), out.end(), [](csf_label *a, csf_label *b) {
+            const str_view *x = a->key(), *y = b->key();
+            int ret = memcmp(x->ptr, y->ptr, x->len < y->len ? x->len : y->len);
+            return ret != 0 ? ret < 0 : x->len < y->len;
+        });
+        return candidates.size();
+    }
+
+
+    size_t posted() { return m_posted; }
+
+    size_t stale() { return m_stale; }
+};
+
+};
+
+#endif
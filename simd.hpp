@@ -0,0 +1,127 @@
+
+
+#ifndef _CSF_SIMD_HPP
+#define _CSF_SIMD_HPP
+
+
+#include "global.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSF_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace csf
+{
+
+// 运行时检测 CPU 支持的指令集，各个 kernel 据此选择实现。
+// 可以通过环境变量 CSF_SIMD=scalar|sse2|avx2 限制最高级别
+class simd
+{
+private:
+    simd() = delete;
+
+public:
+    static const int SCALAR =   0;
+    static const int SSE2   =   1;
+    static const int AVX2   =   2;
+
+
+    static int level()
+    {
+        static const int l = detect();
+        return l;
+    }
+
+
+    static const char* level_name()
+    {
+        switch (level()) {
+            case AVX2:  return "avx2";
+            case SSE2:  return "sse2";
+            default:    return "scalar";
+        }
+    }
+
+
+    // dst[i] = 0xFF - src[i]，即 csf 字符串的混淆与还原，dst 可以等于 src
+    static void invert(uint8_t *dst, const uint8_t *src, size_t len)
+    {
+        size_t i = 0;
+#ifdef CSF_SIMD_X86
+        const int l = level();
+        if (l >= AVX2) {
+            i = invert_avx2(dst, src, len);
+        }
+        else if (l >= SSE2) {
+            i = invert_sse2(dst, src, len);
+        }
+#endif
+        for (; i < len; i++) {
+            dst[i] = 0xFF - src[i];
+        }
+    }
+
+private:
+
+    static int detect()
+    {
+        int l = SCALAR;
+#ifdef CSF_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            l = AVX2;
+        }
+        else if (__builtin_cpu_supports("sse2")) {
+            l = SSE2;
+        }
+#endif
+        const char *env = getenv("CSF_SIMD");
+        if (env != nullptr) {
+            int max = strcmp(env, "scalar") == 0 ? SCALAR : strcmp(env, "sse2") == 0 ? SSE2 : AVX2;
+            if (l > max) l = max;
+        }
+        return l;
+    }
+
+#ifdef CSF_SIMD_X86
+
+    // 返回已处理的字节数，剩余部分由调用者处理
+
+    __attribute__((target("sse2")))
+    static size_t invert_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+    {
+        const __m128i ones = _mm_set1_epi8((char) 0xFF);
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+            _mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(v, ones));
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2")))
+    static size_t invert_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+    {
+        const __m256i ones = _mm256_set1_epi8((char) 0xFF);
+        size_t i = 0;
+        for (; i + 64 <= len; i += 64) {
+            __m256i v1 = _mm256_loadu_si256((const __m256i*) (src + i));
+            __m256i v2 = _mm256_loadu_si256((const __m256i*) (src + i + 32));
+            _mm256_storeu_si256((__m256i*) (dst + i), _mm256_xor_si256(v1, ones));
+            _mm256_storeu_si256((__m256i*) (dst + i + 32), _mm256_xor_si256(v2, ones));
+        }
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+            _mm256_storeu_si256((__m256i*) (dst + i), _mm256_xor_si256(v, ones));
+        }
+        return i;
+    }
+
+#endif
+};
+
+};
+
+#endif
@@ -5,11 +5,16 @@
 
 
 #include "global.hpp"
+#include "arena.hpp"
+#include "buffer.hpp"
+#include "utf.hpp"
+#include "intern.hpp"
 
 namespace csf
 {
 
-using csf_char_t = wchar_t;
+// csf 文件中的字符串是 UTF-16LE，每个码元固定 2 字节
+using csf_char_t = uint16_t;
 
 class csf_string
 {
@@ -22,17 +27,18 @@ private:
     static const uint32_t MAX_EXTRA_LEN =   255;
 
 
+    // m_value 和 m_extra 是只读视图，要么指向映射的文件，
+    // 要么在被修改后指向 csf_file 持有的 arena。
+    // 对象本身只有几十个字节，拷贝时共享同一份内容
     uint32_t m_value_len;
-    csf_char_t m_value[MAX_VALUE_LEN + 1];
     uint32_t m_extra_len;
-    uint8_t m_extra[MAX_EXTRA_LEN + 1];
+    const uint8_t *m_value;
+    const uint8_t *m_extra;
 
 public:
 
-    csf_string() :m_value_len(0), m_extra_len(0)
+    csf_string() : m_value_len(0), m_extra_len(0), m_value(nullptr), m_extra(nullptr)
     {
-        m_value[0] = '\0';
-        m_extra[0] = '\0';
     }
 
     void read_from_file(file_reader& r) 
@@ -53,8 +59,7 @@ public:
             "too long string length %u at %#x, max length is %u\n",
             m_value_len, r.where(), MAX_VALUE_LEN);
 
-        r.read_bytes(m_value, m_value_len * sizeof(csf_char_t));
-        m_value[m_value_len] = '\0';
+        m_value = r.read_view(m_value_len * sizeof(csf_char_t));
 
         if (magic == MAGIC_W) {
             m_extra_len = r.read_int();
@@ -63,9 +68,20 @@ public:
                 "too long extra length %u at %#x, max length is %u\n",
                 m_extra_len, r.where(), MAX_EXTRA_LEN);
 
-            r.read_bytes(m_extra, m_extra_len);
-            m_extra[m_extra_len] = '\0';
+            m_extra = r.read_view(m_extra_len);
         }
+        else {
+            m_extra_len = 0;
+            m_extra = nullptr;
+        }
+    }
+
+
+    // 把内容拷贝到 a 中，之后不再依赖原来的映射文件或 arena
+    void copy_to(arena& a)
+    {
+        m_value = a.copy(m_value, m_value_len * sizeof(csf_char_t));
+        m_extra = a.copy(m_extra, m_extra_len);
     }
 
 
@@ -83,81 +99,110 @@ public:
         }
     }
 
-    char* get_value(int *p_size = nullptr) 
+    // 比较编码后的内容，不需要解码
+    bool same_value(const csf_string& o) const
     {
-        // 1. 对于每个字节，按字节翻转
-        csf_char_t buff[MAX_VALUE_LEN + 1];
-        for (size_t i = 0, n = sizeof(csf_char_t) * m_value_len; i < n; i++) {
-            ((uint8_t*) buff)[i] = 0xFF - ((uint8_t*) m_value)[i];
-        }
-        buff[m_value_len] = '\0';
+        return m_value_len == o.m_value_len &&
+            (m_value_len == 0 || memcmp(m_value, o.m_value, m_value_len * sizeof(csf_char_t)) == 0);
+    }
 
-        // 2. 按照字符数的 3 倍空间申请字节缓冲区
-        size_t buff_len = 3 * m_value_len;
-        char *str = new char[buff_len + 1];
-        int str_len = wcstombs(str, (wchar_t*) buff, buff_len);
+    bool same_extra(const csf_string& o) const
+    {
+        return m_extra_len == o.m_extra_len &&
+            (m_extra_len == 0 || memcmp(m_extra, o.m_extra, m_extra_len) == 0);
+    }
 
-        if (str_len < 0) {
-            delete[] str;
-            str = nullptr;
-            str_len = 0;
-        }
-        if (p_size) *p_size = str_len;
-        return str;
+
+    // 解码后的 UTF-8 追加到 out 末尾，返回追加的字节数
+    size_t get_value(buffer& out)
+    {
+        // 翻转字节和解码在同一遍中完成
+        char *dst = out.reserve(utf::utf8_max_len(m_value_len));
+        size_t n = utf::utf16_to_utf8(m_value, m_value_len, dst, 0xFFFF);
+        out.commit(n);
+        return n;
     }
 
-    char* get_extra(int *p_size = nullptr)
+    // 返回的内容不以 '\0' 结尾，没有 extra 时返回 nullptr
+    const char* get_extra(int *p_size = nullptr)
     {
         if (p_size) *p_size = m_extra_len;
-
-        if (m_extra_len == 0) {
-            return nullptr;
-        }
-
-        char *buff = new char[m_extra_len + 1];
-        memcpy(buff, m_extra, m_extra_len + 1);
-        return buff;
+        return m_extra_len == 0 ? nullptr : (const char*) m_extra;
     }
 
-    void set_extra(const char *src)
+    void set_extra(const char *src, arena& a)
     {
         if (src == nullptr) {
             m_extra_len = 0;
-            m_extra[0] = '\0';
+            m_extra = nullptr;
             return;
         }
 
-        int len = strlen(src);
+        set_extra(src, strlen(src), a);
+    }
 
+    void set_extra(const char *src, size_t len, arena& a)
+    {
         abort_if(len > MAX_EXTRA_LEN, "too long extra length %u, max is %u\n",
-            len, MAX_EXTRA_LEN);
+            (uint32_t) len, MAX_EXTRA_LEN);
 
-        memcpy(m_extra, src, len);
+        m_extra = len == 0 ? nullptr : a.copy(src, len);
         m_extra_len = len;
-        m_extra[m_extra_len] = '\0';
     }
 
-    void set_value(const char *src)
+    void set_value(const char *src, arena& a)
     {
         if (src == nullptr) {
             m_value_len = 0;
-            m_value[0] = '\0';
+            m_value = nullptr;
             return;
         }
+        set_value(src, strlen(src), a);
+    }
 
-        int n = mbstowcs((wchar_t*) m_value, src, MAX_VALUE_LEN);
-        abort_if(n == -1, "invalid multi bytes string\n");
-
+    void set_value(const char *src, size_t len, arena& a)
+    {
+        // 先编码到临时空间，成功后才拷贝到 arena，无效或超长的输入不会在 arena 中留下空间
+        static thread_local buffer scratch;
+        scratch.clear();
+        auto dst = (uint8_t*) scratch.reserve(utf::utf16_len(src, len) * sizeof(csf_char_t));
+        const uint32_t n = encode(src, len, dst);
+        m_value = n == 0 ? nullptr : a.copy(dst, n * sizeof(csf_char_t));
         m_value_len = n;
+    }
 
-        // 反转字节
-        for (int i = 0; i < n * sizeof(wchar_t); i++) {
-            ((uint8_t *) m_value)[i] = 0xFF - ((uint8_t *) m_value)[i];
-        }
+    // 先编码到临时空间，再交给去重池，相同的内容只保存一份
+    void set_value(const char *src, size_t len, intern_pool& pool)
+    {
+        uint8_t *dst = pool.scratch(utf::utf16_len(src, len) * sizeof(csf_char_t));
+        m_value_len = encode(src, len, dst);
+        m_value = pool.intern(dst, m_value_len * sizeof(csf_char_t));
+    }
+
+    void set_extra(const char *src, size_t len, intern_pool& pool)
+    {
+        abort_if(len > MAX_EXTRA_LEN, "too long extra length %u, max is %u\n",
+            (uint32_t) len, MAX_EXTRA_LEN);
+
+        m_extra = pool.intern(src, len);
+        m_extra_len = len;
+    }
+
+private:
+
+    // 转为 UTF-16 并反转字节，返回码元数。超长时报错而不是截断，
+    // 截断可能落在代理对中间，而且读取时同样不接受超过 MAX_VALUE_LEN 的长度
+    static uint32_t encode(const char *src, size_t len, uint8_t *dst)
+    {
+        long n = utf::utf8_to_utf16(src, len, dst);
+        abort_if(n < 0, "invalid utf-8 string\n");
+        abort_if(n > MAX_VALUE_LEN, "too long value length %ld, max is %u\n", n, MAX_VALUE_LEN);
+
+        simd::invert(dst, dst, n * sizeof(csf_char_t));
+        return n;
     }
 };
 
 };
 
 #endif
-
@@ -5,26 +5,182 @@
 #define _CSF_STRING_WRAPPER_HPP
 
 
+#include "global.hpp"
+
 
 namespace csf
 {
 
+// 不以 '\0' 结尾的字符串视图，用于指向映射文件中的 label 名称
+struct str_view
+{
+    const char *ptr;
+    size_t len;
+};
+
+
 class string_utils
 {
 private:
     string_utils() = delete;
 
+
+    // wyhash 的常量与混合函数
+    static const uint64_t SECRET0 = 0x2d358dccaa6c78a5ull;
+    static const uint64_t SECRET1 = 0x8bb84b93962eacc9ull;
+    static const uint64_t SECRET2 = 0x4b33a62ed433d4a3ull;
+    static const uint64_t SECRET3 = 0x4d5a2da51de1aa47ull;
+
+
+    static void mum(uint64_t *a, uint64_t *b)
+    {
+#ifdef __SIZEOF_INT128__
+        unsigned __int128 r = (unsigned __int128) *a * *b;
+        *a = (uint64_t) r;
+        *b = (uint64_t) (r >> 64);
+#else
+        uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        uint64_t t = rl + (rm0 << 32), c = t < rl;
+        uint64_t lo = t + (rm1 << 32);
+        c += lo < t;
+        *a = lo;
+        *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+    }
+
+    static uint64_t mix(uint64_t a, uint64_t b) { mum(&a, &b); return a ^ b; }
+
+
+    // 按 SWAR 的方式把 'A'-'Z' 转为小写，其余字节保持不变
+    static uint64_t fold8(uint64_t x)
+    {
+        const uint64_t ones = 0x0101010101010101ull;
+        uint64_t low = x & (0x7F * ones);
+        uint64_t ge_a = low + (0x80 - 'A') * ones;
+        uint64_t gt_z = low + (0x7F - 'Z') * ones;
+        uint64_t upper = (ge_a ^ gt_z) & ~x & (0x80 * ones);
+        return x | (upper >> 2);
+    }
+
+    static uint8_t fold1(uint8_t c) { return (c >= 'A' && c <= 'Z') ? c + 0x20 : c; }
+
+
+    template <bool FOLD>
+    static uint64_t read8(const uint8_t *p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return FOLD ? fold8(v) : v;
+    }
+
+    template <bool FOLD>
+    static uint64_t read4(const uint8_t *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return FOLD ? (uint32_t) fold8(v) : v;
+    }
+
+    template <bool FOLD>
+    static uint64_t read3(const uint8_t *p, size_t k)
+    {
+        if (FOLD) {
+            return ((uint64_t) fold1(p[0]) << 16) | ((uint64_t) fold1(p[k >> 1]) << 8) | fold1(p[k - 1]);
+        }
+        return ((uint64_t) p[0] << 16) | ((uint64_t) p[k >> 1] << 8) | p[k - 1];
+    }
+
+
+    template <bool FOLD>
+    static uint64_t wyhash(const void *key, size_t len, uint64_t seed)
+    {
+        auto p = (const uint8_t*) key;
+        uint64_t a, b;
+
+        seed ^= mix(seed ^ SECRET0, SECRET1);
+
+        if (len <= 16) {
+            if (len >= 4) {
+                a = (read4<FOLD>(p) << 32) | read4<FOLD>(p + ((len >> 3) << 2));
+                b = (read4<FOLD>(p + len - 4) << 32) | read4<FOLD>(p + len - 4 - ((len >> 3) << 2));
+            }
+            else if (len > 0) {
+                a = read3<FOLD>(p, len);
+                b = 0;
+            }
+            else {
+                a = b = 0;
+            }
+        }
+        else {
+            size_t i = len;
+            if (i > 48) {
+                uint64_t see1 = seed, see2 = seed;
+                do {
+                    seed = mix(read8<FOLD>(p) ^ SECRET1, read8<FOLD>(p + 8) ^ seed);
+                    see1 = mix(read8<FOLD>(p + 16) ^ SECRET2, read8<FOLD>(p + 24) ^ see1);
+                    see2 = mix(read8<FOLD>(p + 32) ^ SECRET3, read8<FOLD>(p + 40) ^ see2);
+                    p += 48;
+                    i -= 48;
+                } while (i > 48);
+                seed ^= see1 ^ see2;
+            }
+            while (i > 16) {
+                seed = mix(read8<FOLD>(p) ^ SECRET1, read8<FOLD>(p + 8) ^ seed);
+                i -= 16;
+                p += 16;
+            }
+            a = read8<FOLD>(p + i - 16);
+            b = read8<FOLD>(p + i - 8);
+        }
+
+        a ^= SECRET1;
+        b ^= seed;
+        mum(&a, &b);
+        return mix(a ^ SECRET0 ^ len, b ^ SECRET1);
+    }
+
 public:
     static bool is_empty(const char *str) { return str == nullptr || *str == '\0'; }
 
 
+    // 64 位 wyhash，雪崩效果好，且每次处理 8 到 48 个字节
+    static uint64_t hash64(const void *data, size_t len, uint64_t seed = 0)
+    {
+        return wyhash<false>(data, len, seed);
+    }
+
+
+    // 忽略 ASCII 大小写的版本，与游戏对 label 名称的处理一致
+    static uint64_t hash64_ci(const void *data, size_t len, uint64_t seed = 0)
+    {
+        return wyhash<true>(data, len, seed);
+    }
+
+
     static int hash(const char *ptr) 
     {
-        int hash = 0;
-        for (auto str = (const char*) ptr; *str; str ++) {
-            hash += 31 * (*str);
+        uint64_t h = hash64(ptr, strlen(ptr));
+        return (int) (h ^ (h >> 32));
+    }
+
+
+    // label 名称使用忽略大小写的 hash，比较时仍然区分大小写，
+    // 仅大小写不同的 label 落在同一个桶中
+    static int hash_view(const str_view *v)
+    {
+        uint64_t h = hash64_ci(v->ptr, v->len);
+        return (int) (h ^ (h >> 32));
+    }
+
+
+    static int compare_view(const str_view *o1, const str_view *o2)
+    {
+        if (o1->len != o2->len) {
+            return o1->len < o2->len ? -1 : 1;
         }
-        return hash;
+        return memcmp(o1->ptr, o2->ptr, o1->len);
     }
 
 
@@ -0,0 +1,101 @@
+#!/bin/sh
+# 命令行级别的回归测试：make check，或者 tests/run.sh [csf_editor 的路径]
+# 测试数据在临时目录中由 import 生成，不依赖游戏文件
+
+EDITOR=$(cd "$(dirname "${1:-./csf_editor.exe}")" && pwd)/$(basename "${1:-./csf_editor.exe}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+FAILED=0
+
+fail()
+{
+    echo "FAIL: $1"
+    FAILED=1
+}
+
+# expect 名称 期望的输出 实际的输出
+expect()
+{
+    if [ "$2" = "$3" ]; then
+        echo "ok: $1"
+    else
+        fail "$1"
+        printf '  expected: %s\n  actual:   %s\n' "$2" "$3"
+    fi
+}
+
+
+# 非 ASCII 和不合法的 extra 字节、孤立的代理项导出后仍是合法的文本，TSV 可以原样读回
+test_export_non_ascii()
+{
+    printf 'X:1\tcaf\303\251\tr\351sum\351\nX:2\tlone \355\240\275 end\t\342\202\254\n' > na.tsv
+    "$EDITOR" -c "import na.tsv; save na.csf; quit" > /dev/null || fail "export: import"
+
+    expect "export tsv" "$(printf 'X:1\tcaf\303\251\tr\\xe9sum\\xe9\nX:2\tlone \\xed\\xa0\\xbd end\t\342\202\254')" \
+        "$("$EDITOR" -c "export tsv -; quit" na.csf)"
+    expect "export json" "$(printf '{"label": "X:1", "value": "caf\303\251", "extra": "r\\u00e9sum\\u00e9"}\n{"label": "X:2", "value": "lone \\ud83d end", "extra": "\342\202\254"}')" \
+        "$("$EDITOR" -c "export json -; quit" na.csf)"
+    expect "export po" "$(printf '#. r\\351sum\\351')" \
+        "$("$EDITOR" -c "export po -; quit" na.csf | grep '^#\.' | head -1)"
+
+    "$EDITOR" -c "export tsv na2.tsv; quit" na.csf > /dev/null
+    "$EDITOR" -c "import na2.tsv; save na2.csf; quit" > /dev/null
+    cmp -s na.csf na2.csf && echo "ok: export tsv round trip" || fail "export tsv round trip"
+}
+
+
+# 本次会话中删除和修改的 label 在之后的 overlay 中保持不变，包括第一次 overlay 之前的删除
+test_remove_then_overlay()
+{
+    printf 'NAME:L00001\tbase1\nNAME:L00002\tbase2\nNAME:L00004\tbase4\n' > base.tsv
+    printf 'NAME:L00002\tmod2\nNAME:L00004\tmod4\nNAME:L00005\tmod5\n' > mod1.tsv
+    printf 'NAME:L00001\tmod1\nNAME:L00004\tmod4b\n' > mod2.tsv
+    for f in base mod1 mod2; do
+        "$EDITOR" -c "import $f.tsv; save $f.csf; quit" > /dev/null || fail "overlay: import $f"
+    done
+
+    expect "remove then overlay" "$(printf '[NAME:L00001]\t[mod1]\t[] \n[NAME:L00002]\t[mine]\t[] \n[NAME:L00005]\t[mod5]\t[] ')" \
+        "$("$EDITOR" -c "remove NAME:L00004; insert --key=NAME:L00002 --value=mine; overlay mod1.csf mod2.csf; list --sort; quit" base.csf | grep '^\[')"
+}
+
+
+# overlay 不进入编辑历史并清空之前的历史，之后的修改照常可以撤销，撤销删除的 label 排在最后
+test_overlay_clears_history()
+{
+    printf 'A\ta\n' > h1.tsv
+    printf 'B\tb\n' > h2.tsv
+    "$EDITOR" -c "import h2.tsv; save h2.csf; quit" > /dev/null
+
+    expect "overlay clears history" "$(printf 'nothing to undo\n[A]\t[a]\t[] \n[B]\t[b]\t[] \nundo remove: 1 labels\n[B]\t[b]\t[] \n[A]\t[a]\t[] ')" \
+        "$("$EDITOR" -k -c "import h1.tsv; overlay h2.csf; undo; list; remove A; undo; list; quit" 2>/dev/null | grep -v '^imported\|^h2.csf')"
+}
+
+
+# 缓存命中和 --verify 时内容与直接打开相同，文件修改之后缓存失效并重建
+test_open_cache()
+{
+    printf 'C:1\tone\nC:2\ttwo\textra\n' > c1.tsv
+    printf 'C:1\tuno\nC:3\ttres\n' > c2.tsv
+    "$EDITOR" -c "import c1.tsv; save c.csf; quit" > /dev/null
+
+    "$EDITOR" -c "open --cache c.csf; quit" > /dev/null
+    [ -f c.csf.cache ] && echo "ok: cache written" || fail "cache written"
+    expect "cache hit" "$(printf 'C:1\tone\nC:2\ttwo\textra')" \
+        "$("$EDITOR" -c "open --cache c.csf; export tsv -; quit")"
+    expect "cache verify" "$(printf 'C:1\tone\nC:2\ttwo\textra')" \
+        "$("$EDITOR" -c "open --verify c.csf; export tsv -; quit")"
+
+    "$EDITOR" -c "import c2.tsv; save c.csf; quit" > /dev/null
+    expect "cache rebuilt" "$(printf 'C:1\tuno\nC:3\ttres')" \
+        "$("$EDITOR" -c "open --cache c.csf; export tsv -; quit")"
+}
+
+
+test_export_non_ascii
+test_remove_then_overlay
+test_overlay_clears_history
+test_open_cache
+
+exit $FAILED
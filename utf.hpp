@@ -0,0 +1,257 @@
+
+
+#ifndef _CSF_UTF_HPP
+#define _CSF_UTF_HPP
+
+
+#include "global.hpp"
+#include "simd.hpp"
+
+
+namespace csf
+{
+
+// 与 locale 无关的 UTF-16LE <-> UTF-8 转码。
+// 孤立的代理项按 3 字节编码 (WTF-8)，保证任意 csf 内容都能原样往返
+class utf
+{
+private:
+    utf() = delete;
+
+
+    static uint16_t load_unit(const uint8_t *p) { return (uint16_t) (p[0] | (p[1] << 8)); }
+
+    static void store_unit(uint8_t *p, uint16_t u) { p[0] = (uint8_t) u; p[1] = (uint8_t) (u >> 8); }
+
+
+    // 以下 kernel 处理开头连续的 ASCII，返回已处理的码元数 (或字节数)，
+    // 遇到非 ASCII 或剩余长度不足一个块时返回
+
+#ifdef CSF_SIMD_X86
+
+    __attribute__((target("sse2")))
+    static size_t ascii_to_utf8_sse2(const uint8_t *src, size_t n, uint8_t *dst, uint16_t key)
+    {
+        const __m128i k = _mm_set1_epi16((short) key);
+        const __m128i mask = _mm_set1_epi16((short) 0xFF80);
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i v1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (src + 2 * i)), k);
+            __m128i v2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (src + 2 * i + 16)), k);
+            __m128i hi = _mm_and_si128(_mm_or_si128(v1, v2), mask);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(hi, zero)) != 0xFFFF) {
+                break;
+            }
+            _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(v1, v2));
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2")))
+    static size_t ascii_to_utf8_avx2(const uint8_t *src, size_t n, uint8_t *dst, uint16_t key)
+    {
+        const __m256i k = _mm256_set1_epi16((short) key);
+        const __m256i mask = _mm256_set1_epi16((short) 0xFF80);
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i v1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (src + 2 * i)), k);
+            __m256i v2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (src + 2 * i + 32)), k);
+            if (! _mm256_testz_si256(_mm256_or_si256(v1, v2), mask)) {
+                break;
+            }
+            // packus 按 128 位分别打包，需要重新排列 64 位块的顺序
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v1, v2), 0xD8);
+            _mm256_storeu_si256((__m256i*) (dst + i), packed);
+        }
+        return i + ascii_to_utf8_sse2(src + 2 * i, n - i, dst + i, key);
+    }
+
+    __attribute__((target("sse2")))
+    static size_t ascii_to_utf16_sse2(const uint8_t *src, size_t len, uint8_t *dst)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+            if (_mm_movemask_epi8(v) != 0) {
+                break;
+            }
+            _mm_storeu_si128((__m128i*) (dst + 2 * i), _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i*) (dst + 2 * i + 16), _mm_unpackhi_epi8(v, zero));
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2")))
+    static size_t ascii_to_utf16_avx2(const uint8_t *src, size_t len, uint8_t *dst)
+    {
+        size_t i = 0;
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) (src + i));
+            if (_mm256_movemask_epi8(v) != 0) {
+                break;
+            }
+            __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+            __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+            _mm256_storeu_si256((__m256i*) (dst + 2 * i), lo);
+            _mm256_storeu_si256((__m256i*) (dst + 2 * i + 32), hi);
+        }
+        return i + ascii_to_utf16_sse2(src + i, len - i, dst + 2 * i);
+    }
+
+#endif
+
+public:
+
+    // n 个 UTF-16 码元转为 UTF-8 时最多需要的字节数
+    static size_t utf8_max_len(size_t n) { return 3 * n; }
+
+
+    // src 为 n 个小端序的 UTF-16 码元，不要求对齐，返回写入 dst 的字节数。
+    // 每个码元先与 key 异或，key 为 0xFFFF 时即在同一遍中还原 csf 的混淆
+    static size_t utf16_to_utf8(const uint8_t *src, size_t n, char *dst, uint16_t key = 0)
+    {
+        auto out = (uint8_t*) dst;
+        size_t i = 0;
+#ifdef CSF_SIMD_X86
+        const int level = simd::level();
+#endif
+
+        while (i < n) {
+#ifdef CSF_SIMD_X86
+            // 大部分内容是 ASCII，整块处理
+            size_t k = 0;
+            if (level >= simd::AVX2) {
+                k = ascii_to_utf8_avx2(src + 2 * i, n - i, out, key);
+            }
+            else if (level >= simd::SSE2) {
+                k = ascii_to_utf8_sse2(src + 2 * i, n - i, out, key);
+            }
+            out += k;
+            i += k;
+            if (i >= n) break;
+#endif
+            uint32_t c = load_unit(src + 2 * i) ^ key;
+            i ++;
+
+            if (c < 0x80) {
+                *out++ = (uint8_t) c;
+                continue;
+            }
+            if (c < 0x800) {
+                *out++ = (uint8_t) (0xC0 | (c >> 6));
+                *out++ = (uint8_t) (0x80 | (c & 0x3F));
+                continue;
+            }
+            if (c >= 0xD800 && c < 0xDC00 && i < n) {
+                uint32_t d = load_unit(src + 2 * i) ^ key;
+                if (d >= 0xDC00 && d < 0xE000) {
+                    i ++;
+                    c = 0x10000 + ((c - 0xD800) << 10) + (d - 0xDC00);
+                    *out++ = (uint8_t) (0xF0 | (c >> 18));
+                    *out++ = (uint8_t) (0x80 | ((c >> 12) & 0x3F));
+                    *out++ = (uint8_t) (0x80 | ((c >> 6) & 0x3F));
+                    *out++ = (uint8_t) (0x80 | (c & 0x3F));
+                    continue;
+                }
+            }
+            *out++ = (uint8_t) (0xE0 | (c >> 12));
+            *out++ = (uint8_t) (0x80 | ((c >> 6) & 0x3F));
+            *out++ = (uint8_t) (0x80 | (c & 0x3F));
+        }
+        return out - (uint8_t*) dst;
+    }
+
+
+    // 返回 UTF-8 字符串转为 UTF-16 后码元数的上限，不做合法性校验
+    static long utf16_len(const char *src, size_t len)
+    {
+        auto p = (const uint8_t*) src;
+        long n = 0;
+        for (size_t i = 0; i < len; i++) {
+            // 每个非后续字节对应一个码元，4 字节序列对应一对代理项
+            n += (p[i] & 0xC0) != 0x80;
+            n += p[i] >= 0xF0;
+        }
+        return n;
+    }
+
+
+    // p 处一个 UTF-8 (含 WTF-8 的代理项) 序列的字节数，不合法时返回 0。
+    // 解码出的码点写入 *p_c，代理项即 0xD800 ~ 0xDFFF
+    static int decode_char(const uint8_t *p, size_t len, uint32_t *p_c)
+    {
+        uint32_t c = p[0];
+        size_t extra;
+
+        if (c < 0x80)       { *p_c = c; return 1; }
+        else if (c < 0xC2)  { return 0; }
+        else if (c < 0xE0)  { extra = 1; c &= 0x1F; }
+        else if (c < 0xF0)  { extra = 2; c &= 0x0F; }
+        else if (c < 0xF5)  { extra = 3; c &= 0x07; }
+        else                { return 0; }
+
+        if (extra >= len) {
+            return 0;
+        }
+        for (size_t k = 1; k <= extra; k++) {
+            if ((p[k] & 0xC0) != 0x80) return 0;
+            c = (c << 6) | (p[k] & 0x3F);
+        }
+        if ((extra == 2 && c < 0x800) || (extra == 3 && (c < 0x10000 || c > 0x10FFFF))) {
+            return 0;
+        }
+        *p_c = c;
+        return (int) extra + 1;
+    }
+
+    // 返回写入 dst 的码元数，dst 至少要有 utf16_len() 个码元的空间，不合法时返回 -1
+    static long utf8_to_utf16(const char *src, size_t len, uint8_t *dst)
+    {
+        auto p = (const uint8_t*) src;
+        uint8_t *out = dst;
+        size_t i = 0;
+
+#ifdef CSF_SIMD_X86
+        const int level = simd::level();
+#endif
+
+        while (i < len) {
+#ifdef CSF_SIMD_X86
+            size_t k = 0;
+            if (level >= simd::AVX2) {
+                k = ascii_to_utf16_avx2(p + i, len - i, out);
+            }
+            else if (level >= simd::SSE2) {
+                k = ascii_to_utf16_sse2(p + i, len - i, out);
+            }
+            out += 2 * k;
+            i += k;
+            if (i >= len) break;
+#endif
+            uint32_t c;
+            const int n = decode_char(p + i, len - i, &c);
+            if (n == 0) {
+                return -1;
+            }
+            i += n;
+
+            if (c >= 0x10000) {
+                c -= 0x10000;
+                store_unit(out, (uint16_t) (0xD800 + (c >> 10)));
+                store_unit(out + 2, (uint16_t) (0xDC00 + (c & 0x3FF)));
+                out += 4;
+            }
+            else {
+                store_unit(out, (uint16_t) c);
+                out += 2;
+            }
+        }
+        return (out - dst) / 2;
+    }
+};
+
+};
+
+#endif